@@ -1,17 +1,25 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/sendfile.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
+// bounce buffer for host transfers the kernel can't do for us
+#define DISK_COPY_BLOCKS 256
+
 static FILE *diskfile;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int ndiscards=0;
 
 int disk_init( const char *filename, int n )
 {
@@ -24,6 +32,7 @@ int disk_init( const char *filename, int n )
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	ndiscards = 0;
 
 	return 1;
 }
@@ -79,11 +88,196 @@ void disk_write( int blocknum, const char *data )
 	}
 }
 
+// read count consecutive blocks with one system call. this bypasses the
+// shared stdio stream, so several threads may call it at once
+void disk_read_range( int blocknum, int count, char *data )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	size_t length = (size_t)count*DISK_BLOCK_SIZE;
+	size_t done = 0;
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+
+	// make sure buffered writes are visible to the raw descriptor
+	fflush(diskfile);
+
+	while(done<length) {
+		ssize_t result = pread(fileno(diskfile),data+done,length-done,offset+done);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",result<0 ? strerror(errno) : "short read");
+			abort();
+		}
+		done += result;
+	}
+
+	__sync_fetch_and_add(&nreads,count);
+}
+
+// a fresh buffer per transfer, since imports may run on several threads
+static char *disk_copybuffer()
+{
+	char *buffer;
+	if(posix_memalign((void**)&buffer,DISK_BLOCK_SIZE,DISK_COPY_BLOCKS*DISK_BLOCK_SIZE)) {
+		printf("ERROR: couldn't allocate copy buffer\n");
+		abort();
+	}
+	return buffer;
+}
+
+// fill count blocks starting at blocknum with length bytes read from the
+// current position of the host descriptor fd, zero filling the rest of the
+// last block. the kernel moves the data when it can, otherwise it goes
+// through one large aligned buffer. safe to call from several threads at
+// once. returns the number of bytes taken from fd, which is short only if
+// fd ran out
+int disk_import( int blocknum, int count, int fd, int length )
+{
+	int imagefd = fileno(diskfile);
+	off_t dst = (off_t)blocknum*DISK_BLOCK_SIZE;
+	off_t end = dst+(off_t)count*DISK_BLOCK_SIZE;
+	ssize_t result = 0;
+	int done = 0;
+
+	sanity_check(blocknum,&fd);
+	sanity_check(blocknum+count-1,&fd);
+	fflush(diskfile);
+
+	while(done<length) {
+		result = copy_file_range(fd,0,imagefd,&dst,length-done,0);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) break;
+		done += result;
+	}
+
+	if(done<length) {
+		char *buffer = disk_copybuffer();
+		while(done<length) {
+			int chunk = length-done;
+			if(chunk>DISK_COPY_BLOCKS*DISK_BLOCK_SIZE) chunk = DISK_COPY_BLOCKS*DISK_BLOCK_SIZE;
+			result = read(fd,buffer,chunk);
+			if(result<0 && errno==EINTR) continue;
+			if(result<=0) break;
+			if(pwrite(imagefd,buffer,result,dst)!=result) {
+				printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+				abort();
+			}
+			dst += result;
+			done += result;
+		}
+		free(buffer);
+	}
+
+	if(dst<end) {
+		static const char zero[DISK_BLOCK_SIZE];
+		while(dst<end) {
+			int chunk = (end-dst<DISK_BLOCK_SIZE) ? end-dst : DISK_BLOCK_SIZE;
+			if(pwrite(imagefd,zero,chunk,dst)!=chunk) {
+				printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+				abort();
+			}
+			dst += chunk;
+		}
+	}
+
+	__sync_fetch_and_add(&nwrites,count);
+	return done;
+}
+
+// append length bytes starting at blocknum to the host descriptor fd at its
+// current position. tries copy_file_range, then sendfile, then a buffer;
+// the image never runs out early, so any method that stops short simply
+// hands the rest to the next one. returns the number of bytes written to fd
+int disk_export( int blocknum, int fd, int length )
+{
+	int imagefd = fileno(diskfile);
+	off_t src = (off_t)blocknum*DISK_BLOCK_SIZE;
+	ssize_t result = 0;
+	int done = 0;
+
+	sanity_check(blocknum,&fd);
+	sanity_check(blocknum+(length-1)/DISK_BLOCK_SIZE,&fd);
+	fflush(diskfile);
+
+	while(done<length) {
+		result = copy_file_range(imagefd,&src,fd,0,length-done,0);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) break;
+		done += result;
+	}
+
+	while(done<length) {
+		result = sendfile(fd,imagefd,&src,length-done);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) break;
+		done += result;
+	}
+
+	if(done<length) {
+		char *buffer = disk_copybuffer();
+		while(done<length) {
+			int chunk = length-done;
+			if(chunk>DISK_COPY_BLOCKS*DISK_BLOCK_SIZE) chunk = DISK_COPY_BLOCKS*DISK_BLOCK_SIZE;
+			if(pread(imagefd,buffer,chunk,src)!=chunk) {
+				printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+				abort();
+			}
+			int written = 0;
+			while(written<chunk) {
+				result = write(fd,buffer+written,chunk-written);
+				if(result<0 && errno==EINTR) continue;
+				if(result<=0) break;
+				written += result;
+			}
+			src += written;
+			done += written;
+			if(written<chunk) break;
+		}
+		free(buffer);
+	}
+
+	nreads += (done+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	return done;
+}
+
+// release a run of blocks back to the host: they read back as zeros afterwards
+// and no longer take up space in the image file
+void disk_discard( int blocknum, int count )
+{
+	static const char zero[DISK_BLOCK_SIZE];
+	int i;
+
+	if(count<=0) return;
+	sanity_check(blocknum,zero);
+	sanity_check(blocknum+count-1,zero);
+
+	// push out anything stdio still buffers for this range before punching it
+	fflush(diskfile);
+
+	if(fallocate(fileno(diskfile),FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+	             (off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE)==0) {
+		ndiscards += count;
+		return;
+	}
+
+	if(errno!=EOPNOTSUPP && errno!=ENOSYS) {
+		printf("ERROR: couldn't discard blocks %d-%d: %s\n",blocknum,blocknum+count-1,strerror(errno));
+		abort();
+	}
+
+	// host filesystem can't punch holes, so at least keep the zero-fill semantics
+	for(i=0;i<count;i++) {
+		disk_write(blocknum+i,zero);
+	}
+}
+
 void disk_close()
 {
 	if(diskfile) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
+		printf("%d disk block discards\n",ndiscards);
 		fclose(diskfile);
 		diskfile = 0;
 	}
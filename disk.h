@@ -6,7 +6,11 @@
 int  disk_init( const char *filename, int nblocks );
 int  disk_size();
 void disk_read( int blocknum, char *data );
+void disk_read_range( int blocknum, int count, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_discard( int blocknum, int count );
+int  disk_import( int blocknum, int count, int fd, int length );
+int  disk_export( int blocknum, int fd, int length );
 void disk_close();
 
 
@@ -1,20 +1,75 @@
 #include "fs.h"
 #include "disk.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define FS_MAGIC           0xf0f03410
 #define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
 #define BLOCK_SIZE 4096
+//the in-memory bitmap holds a reference count per block, so FREE is zero
+//references and TAKEN is one; shared blocks simply count higher
 #define FREE 0
 #define TAKEN 1
 
+//isvalid doubles as the inode flag word, so any nonzero value is still valid
+#define INODE_VALID      1
+#define INODE_COMPRESSED 2
+#define INODE_DEDUP      4
+#define INODE_SYSTEM     8
+#define INODE_DIR        16
+#define INODE_NAMED      32   // a directory entry points here
+
+//max number of logical blocks one inode can address
+#define MAX_FILE_BLOCKS (POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+
+//compressed files are stored in clusters of CLUSTER_BLOCKS logical blocks.
+//a cluster takes CLUSTER_BLOCKS slots of the block map: a full cluster is
+//stored raw, a shorter one starts with its compressed length, and one with
+//no blocks at all reads back as zeros
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define MAX_FILE_CLUSTERS (MAX_FILE_BLOCKS / CLUSTER_BLOCKS)
+
+//dedup index: an open-addressed table of block hashes, roughly one slot per
+//disk block, kept in memory and mirrored into a reserved system inode
+#define DEDUP_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct dedup_entry))
+#define DEDUP_PROBES 4
+
+//directories are hash tables: a power-of-two number of bucket blocks, each
+//a fixed array of entries. a full bucket doubles the table by splitting
+//every bucket in two, so a lookup only ever reads one bucket
+#define FS_NAME_MAX 55
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct fs_dirent))
+#define DCACHE_SIZE 1024
+
+//the inode table scan used by mount and the checker: each thread takes a
+//slice of the inode blocks and reads them SCAN_BATCH blocks at a time
+#define SCAN_BATCH 64
+#define SCAN_MAX_THREADS 16
+
+//buffer size for host transfers that can't skip fs_read/fs_write
+#define COPY_BUFFER_SIZE (256 * BLOCK_SIZE)
+
+//what a block was referenced as during a scan
+#define ROLE_DATA     1
+#define ROLE_INDIRECT 2
+#define ROLE_META     4   // directory bucket or dedup index, never shared
+
+//data blocks per allocation group; each group also owns a proportional
+//slice of the inode table
+#define GROUP_BLOCKS 4096
+
 
 
 int * bitmap = NULL; //initialized when mount
@@ -27,8 +82,26 @@ struct fs_superblock {
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int dedupinode;   // system inode holding the dedup index, 0 if none
+	int rootinode;    // root directory, 0 until the namespace is first used
+	int ngroups;      // allocation groups, garbage on images older than groups
+};
+
+//an allocation group: a slice of the inode table and the data blocks its
+//files are placed in. nfree summarizes the group's part of the bitmap, and
+//lock covers both, so threads allocating in different groups don't meet
+struct fs_group {
+	pthread_mutex_t lock;
+	int firstinode;   // inode blocks [firstinode, lastinode)
+	int lastinode;
+	int first;        // data blocks [first, last)
+	int last;
+	int nfree;
 };
 
+struct fs_group * groups = NULL; //set up when mount
+int ngroups = 0;
+
 struct fs_inode {
 	int isvalid;
 	int size;
@@ -36,13 +109,52 @@ struct fs_inode {
 	int indirect;
 };
 
+struct fs_dirent {
+	int inumber;      // 0 for an empty slot
+	unsigned hash;
+	char name[FS_NAME_MAX + 1];
+};
+
 union fs_block {
 	struct fs_superblock super;
 	struct fs_inode inode[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_dirent dirent[DIRENTS_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 };
 
+struct dedup_entry {
+	unsigned hash;
+	int blocknum;     // 0 for an empty slot
+};
+
+struct dedup_entry * dedup_index = NULL; //loaded when mount, or on first fs_dedup
+int * dedup_blocks = NULL;  //disk blocks backing each block of the index
+char * dedup_dirty = NULL;  //index blocks changed since the last flush
+int dedup_nblocks = 0;
+int * dedup_slot = NULL;    //index slot + 1 naming each disk block, 0 if none
+
+static void dedup_load();
+static void dedup_forget(int blocknum);
+static void dedup_prune(int nblocks);
+static void dedup_flush();
+static int compare_blocknum(const void *a, const void *b);
+static void group_setup(struct fs_superblock *super);
+static int inode_group(int inumber);
+static int group_roomy();
+static void free_block(int blocknum);
+
+//recently resolved names, keyed by parent directory and name
+struct dcache_entry {
+	int dir;
+	int inumber;
+	char name[FS_NAME_MAX + 1];
+};
+
+struct dcache_entry dcache[DCACHE_SIZE];
+int root_inumber = 0; //resolved on first use of the namespace
+int defrag_next = 1;  //inode the next defrag pass resumes from
+
 
 //an attempt to format an already-mounted disk should do nothing and return failure
 int fs_format()
@@ -56,9 +168,13 @@ int fs_format()
 	int nblocks = disk_size();
 	
 	//clear all the data existed in blocks
+	//punching the whole image leaves it fully sparse, and the zeroed inode
+	//table needs no explicit writes because holes read back as zeros
+	disk_discard(0, nblocks);
 
 	// initialize super block
 	union fs_block data;
+	memset(data.data, 0, sizeof(data.data));
 	//set nblocks
 	data.super.nblocks = nblocks;
 	//set ninode block
@@ -66,32 +182,41 @@ int fs_format()
 	data.super.ninodeblocks = inodesblocks;
 	data.super.ninodes = inodesblocks * INODES_PER_BLOCK;
 	data.super.magic = FS_MAGIC;
+	int ndata = nblocks - inodesblocks - 1;
+	data.super.ngroups = (ndata + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+	if(data.super.ngroups > inodesblocks)
+		data.super.ngroups = inodesblocks;
+	if(data.super.ngroups < 1)
+		data.super.ngroups = 1;
 	//printf("in format: ninodesblocks: %d ninodes: %d\n",data.super.ninodeblocks, data.super.ninodes);
 	disk_write(0, data.data);
 
-	//set aside ten percent blocks as inode block
-	// bit map should obey the rule that the first block is for super block
-	//and the first 10% blocks are used for inodes
-	for(int i = 1; i < inodesblocks; i++){
-		union fs_block block;
-		for(int j = 0; j < INODES_PER_BLOCK; j++){
-			block.inode[j].isvalid = 0;
-			block.inode[j].size = 0;
-			// clear all the pointer(direct & indrect)
-			memset(block.inode[j].direct, 0, POINTERS_PER_INODE * 4);
-			block.inode[j].indirect = 0;
-		}
-		disk_write(i, block.data);
-	}
-
 	//block.super.ninodeblocks
 	return 1;
 }
 
+//number of physically contiguous runs a file's data falls into, walking
+//its blocks in logical order. holes don't break a run
+static int count_extents(const struct fs_inode *inode, const int *indirect, int *mapped)
+{
+	int extents = 0;
+	int prev = -1;
+	*mapped = 0;
+	for (int n = 0; n < MAX_FILE_BLOCKS; n++){
+		int blocknum = (n < POINTERS_PER_INODE) ? inode->direct[n] : indirect[n - POINTERS_PER_INODE];
+		if (blocknum == 0){continue;}
+		if (blocknum != prev + 1){extents++;}
+		prev = blocknum;
+		(*mapped)++;
+	}
+	return extents;
+}
+
 //Scan a mounted filesystem and report on how the inodes and blocks are organized
 void fs_debug()
 {
 	union fs_block block;
+	int nfiles = 0, nfragmented = 0, totalextents = 0;
 
 	disk_read(0,block.data);
 
@@ -105,10 +230,14 @@ void fs_debug()
 	printf("    %d blocks on disk\n",block.super.nblocks);
 	printf("    %d blocks for inodes\n",block.super.ninodeblocks);
 	printf("    %d inodes total\n",block.super.ninodes);
+	int groupcount = block.super.ngroups;
+	if(groupcount > block.super.ninodeblocks)
+		groupcount = block.super.ninodeblocks;
+	printf("    %d allocation groups\n",(groupcount > 0) ? groupcount : 1);
 
 	int ninodeblocks = block.super.ninodeblocks;
 	if (ninodeblocks < 0){return;}
-	for (int i = 1; i< ninodeblocks; i++){ // each inode block
+	for (int i = 1; i<= ninodeblocks; i++){ // each inode block
 		disk_read(i,block.data);
 		for (int j = 0; j < INODES_PER_BLOCK; j++){ // each inode
 			struct fs_inode inode = block.inode[j];
@@ -116,8 +245,20 @@ void fs_debug()
 				//printf("inode.isvalid %d\n", inode.isvalid);
 				continue;
 			}
-			printf("inode %d:\n", j+i*INODES_PER_BLOCK + 1);
-			printf("    size: %d bytes\n",fs_getsize(j+i*INODES_PER_BLOCK + 1));
+			printf("inode %d:\n", j+(i-1)*INODES_PER_BLOCK + 1);
+			printf("    size: %d bytes\n",inode.size);
+			if (inode.isvalid & INODE_COMPRESSED){
+				printf("    compressed in %d block clusters\n", CLUSTER_BLOCKS);
+			}
+			if (inode.isvalid & INODE_DEDUP){
+				printf("    deduplicated\n");
+			}
+			if (inode.isvalid & INODE_SYSTEM){
+				printf("    reserved for the dedup index\n");
+			}
+			if (inode.isvalid & INODE_DIR){
+				printf("    directory with %d hash buckets\n", inode.size / BLOCK_SIZE);
+			}
 			printf("    direct blocks: ");
 			for (int k = 0;k<POINTERS_PER_INODE; k++){
 				int pointedblock = inode.direct[k];
@@ -127,20 +268,203 @@ void fs_debug()
 			}
 			printf("\n");
 
-			if (!inode.indirect){continue;}
-			printf("    indirect block: %d\n", inode.indirect);
-			printf("    indirect data blocks: "); 
 			union fs_block indirectblock;
-			disk_read(inode.indirect, indirectblock.data);
-			for (int l = 0; l < POINTERS_PER_BLOCK; l++){
-                        	if (indirectblock.pointers[l]!=0){
-					printf("%d ",indirectblock.pointers[l]);
+			memset(indirectblock.data, 0, sizeof(indirectblock.data));
+			if (inode.indirect){
+				printf("    indirect block: %d\n", inode.indirect);
+				printf("    indirect data blocks: "); 
+				disk_read(inode.indirect, indirectblock.data);
+				for (int l = 0; l < POINTERS_PER_BLOCK; l++){
+					if (indirectblock.pointers[l]!=0){
+						printf("%d ",indirectblock.pointers[l]);
+					}
 				}
-			
+				printf("\n");	
+			}
+
+			int mapped;
+			int extents = count_extents(&inode, indirectblock.pointers, &mapped);
+			printf("    fragmentation: %d extents over %d blocks\n", extents, mapped);
+			nfiles++;
+			totalextents += extents;
+			if (extents > 1){nfragmented++;}
+		}
+	}
+	printf("fragmentation:\n");
+	printf("    %d of %d files in more than one extent\n", nfragmented, nfiles);
+	printf("    %d extents total\n", totalextents);
+}
+
+//one thread's share of an inode table scan. refs and roles are private
+//to the thread and merged afterwards
+struct scan_job {
+	struct fs_superblock super;
+	int first, last;   // inode blocks [first, last)
+	int *refs;         // references seen per block
+	char *roles;       // ROLE_* bits seen per block
+	int nerrors;
+	int nbrokendirs;   // directories with a broken bucket table, not repairable
+	int nindirect;     // indirect blocks read
+	int report;        // print each problem as it is found
+};
+
+static int scan_pointer(struct scan_job *job, int inumber, int blocknum, int role)
+{
+	if(blocknum <= job->super.ninodeblocks || blocknum >= job->super.nblocks){
+		if(job->report)
+			printf("inode %d points outside the data region at block %d\n", inumber, blocknum);
+		job->nerrors++;
+		return 0;
+	}
+	job->refs[blocknum]++;
+	job->roles[blocknum] |= role;
+	return 1;
+}
+
+static void scan_inode(struct scan_job *job, int inumber, struct fs_inode *inode)
+{
+	union fs_block indirect;
+	int role = (inode->isvalid & (INODE_DIR | INODE_SYSTEM)) ? ROLE_META : ROLE_DATA;
+	int k;
+
+	if(inode->size < 0 || inode->size > MAX_FILE_BLOCKS * BLOCK_SIZE){
+		if(job->report)
+			printf("inode %d has impossible size %d\n", inumber, inode->size);
+		job->nerrors++;
+	}
+	memset(indirect.data, 0, sizeof(indirect.data));
+	for(k = 0; k < POINTERS_PER_INODE; k++){
+		if(inode->direct[k])
+			scan_pointer(job, inumber, inode->direct[k], role);
+	}
+	if(inode->indirect && scan_pointer(job, inumber, inode->indirect, ROLE_INDIRECT)){
+		disk_read_range(inode->indirect, 1, indirect.data);
+		job->nindirect++;
+		for(k = 0; k < POINTERS_PER_BLOCK; k++){
+			if(indirect.pointers[k])
+				scan_pointer(job, inumber, indirect.pointers[k], role);
+		}
+	}
+
+	if(inode->isvalid & INODE_DIR){
+		int nbuckets = inode->size / BLOCK_SIZE;
+		int missing = (nbuckets <= 0 || (nbuckets & (nbuckets - 1)) || nbuckets > MAX_FILE_BLOCKS);
+		for(k = 0; !missing && k < nbuckets; k++){
+			if((k < POINTERS_PER_INODE ? inode->direct[k] : indirect.pointers[k - POINTERS_PER_INODE]) == 0)
+				missing = 1;
+		}
+		if(missing){
+			if(job->report)
+				printf("directory %d has a broken bucket table\n", inumber);
+			job->nerrors++;
+			job->nbrokendirs++;
+		}
+	}
+
+	//only a dedup file may hold the same block at two offsets; anywhere else
+	//one of the pointers is a double allocation and a block leaked
+	if(!(inode->isvalid & INODE_DEDUP)){
+		int blocks[MAX_FILE_BLOCKS + 1];
+		int n = 0;
+		for(k = 0; k < POINTERS_PER_INODE; k++){
+			if(inode->direct[k])
+				blocks[n++] = inode->direct[k];
+		}
+		if(inode->indirect){
+			blocks[n++] = inode->indirect;
+			for(k = 0; k < POINTERS_PER_BLOCK; k++){
+				if(indirect.pointers[k])
+					blocks[n++] = indirect.pointers[k];
+			}
+		}
+		qsort(blocks, n, sizeof(int), compare_blocknum);
+		for(k = 1; k < n; k++){
+			if(blocks[k] != blocks[k - 1] || (k > 1 && blocks[k] == blocks[k - 2]))
+				continue;
+			if(job->report)
+				printf("inode %d points at block %d more than once\n", inumber, blocks[k]);
+			job->nerrors++;
+		}
+	}
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_job *job = arg;
+	union fs_block *batch = malloc(SCAN_BATCH * sizeof(union fs_block));
+	for(int i = job->first; i < job->last; i += SCAN_BATCH){
+		int count = (job->last - i < SCAN_BATCH) ? job->last - i : SCAN_BATCH;
+		disk_read_range(i, count, batch[0].data);
+		for(int b = 0; b < count; b++){
+			for(int j = 0; j < INODES_PER_BLOCK; j++){
+				if(batch[b].inode[j].isvalid)
+					scan_inode(job, (i + b - 1) * INODES_PER_BLOCK + j + 1, &batch[b].inode[j]);
 			}
-			printf("\n");	
 		}
 	}
+	free(batch);
+	return NULL;
+}
+
+static int scan_threads()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+		return 1;
+	return (n > SCAN_MAX_THREADS) ? SCAN_MAX_THREADS : n;
+}
+
+//walk the whole inode table with nthreads threads. the merged reference
+//counts and roles are left in result, which the caller frees
+static void scan_inodes(struct fs_superblock *super, int nthreads, int report, struct scan_job *result)
+{
+	struct scan_job jobs[SCAN_MAX_THREADS];
+	pthread_t threads[SCAN_MAX_THREADS];
+	int i, b;
+
+	if(nthreads < 1)
+		nthreads = 1;
+	if(nthreads > SCAN_MAX_THREADS)
+		nthreads = SCAN_MAX_THREADS;
+	if(nthreads > super->ninodeblocks)
+		nthreads = (super->ninodeblocks > 0) ? super->ninodeblocks : 1;
+
+	int per = (super->ninodeblocks + nthreads - 1) / nthreads;
+	for(i = 0; i < nthreads; i++){
+		struct scan_job *job = &jobs[i];
+		job->super = *super;
+		job->first = 1 + i * per;
+		job->last = 1 + (i + 1) * per;
+		if(job->last > super->ninodeblocks + 1)
+			job->last = super->ninodeblocks + 1;
+		if(job->first > job->last)
+			job->first = job->last;
+		job->refs = calloc(super->nblocks, sizeof(int));
+		job->roles = calloc(super->nblocks, 1);
+		job->nerrors = 0;
+		job->nbrokendirs = 0;
+		job->nindirect = 0;
+		job->report = report;
+	}
+	for(i = 1; i < nthreads; i++){
+		pthread_create(&threads[i], NULL, scan_worker, &jobs[i]);
+	}
+	scan_worker(&jobs[0]);
+	for(i = 1; i < nthreads; i++){
+		pthread_join(threads[i], NULL);
+		for(b = 0; b < super->nblocks; b++){
+			jobs[0].refs[b] += jobs[i].refs[b];
+			jobs[0].roles[b] |= jobs[i].roles[b];
+		}
+		jobs[0].nerrors += jobs[i].nerrors;
+		jobs[0].nbrokendirs += jobs[i].nbrokendirs;
+		jobs[0].nindirect += jobs[i].nindirect;
+		free(jobs[i].refs);
+		free(jobs[i].roles);
+	}
+	*result = jobs[0];
+	result->first = 1;
+	result->last = super->ninodeblocks + 1;
 }
 
 //build a new free block bitmap
@@ -153,37 +477,48 @@ int fs_mount()
 	union fs_block block;
 	disk_read(0,block.data);
 	int ninodeblocks = block.super.ninodeblocks;
-	int nblocks = block.super.nblocks;
-	int i,j,k;
-	int fileblocks; // file_size/block_size
-	struct fs_inode inode;
-	union fs_block datablock;
-	bitmap = (int *)malloc(nblocks);
-	memset(bitmap,0,nblocks);
-	bitmap[0] = TAKEN;
-	for(i = 1; i <= ninodeblocks; i++){
+
+	//walk every pointer rather than trusting the size, since compressed and
+	//sparse files leave holes in the block map. each pointer is one
+	//reference, deduplicated and cloned blocks get several
+	struct scan_job scan;
+	scan_inodes(&block.super, scan_threads(), 0, &scan);
+	if(scan.nerrors)
+		printf("%d problems found while mounting, run fsck\n", scan.nerrors);
+	free(scan.roles);
+
+	bitmap = scan.refs;
+	for(int i = 0; i <= ninodeblocks && i < block.super.nblocks; i++){
 		bitmap[i] = TAKEN;
-		disk_read(i,block.data);
-		for(j = 0; j < INODES_PER_BLOCK; j++){
-			inode = block.inode[j];
-			if(inode.isvalid){
-				fileblocks = inode.size / BLOCK_SIZE;
-				if(inode.size % BLOCK_SIZE){
-					fileblocks++;
-				}
-				for(k = 0; k < POINTERS_PER_INODE; k++){
-					bitmap[inode.direct[k]] = TAKEN;
-				}
-				if(fileblocks > POINTERS_PER_INODE){
-					disk_read(inode.indirect,datablock.data);
-					for(k = 0; k < (fileblocks - POINTERS_PER_INODE); k++){
-						bitmap[datablock.pointers[k]] = TAKEN;
-					}
+	}
+	group_setup(&block.super);
+	dedup_load();
+	return 1;
+}
+
+//take the first free inode in group's slice of the inode table, moving on
+//to the following groups only when that slice is full
+static int inode_alloc(int group)
+{
+	union fs_block block;
+	disk_read(0, block.data);
+	for(int g = 0; g < ngroups; g++){
+		struct fs_group *slice = &groups[(group + g) % ngroups];
+		for(int i = slice->firstinode; i < slice->lastinode; i++){
+			union fs_block tempblock;
+			disk_read(i, tempblock.data);
+			for(int j = 0; j < INODES_PER_BLOCK; j++){
+				if(tempblock.inode[j].isvalid == 0){
+					tempblock.inode[j].isvalid = 1;
+					tempblock.inode[j].size = 0;
+					disk_write(i, tempblock.data);
+					disk_write(0, block.data);
+					return (i - 1) * INODES_PER_BLOCK + j + 1;
 				}
 			}
 		}
 	}
-	return 1;
+	return -1;
 }
 
 int fs_create()
@@ -192,24 +527,51 @@ int fs_create()
 		printf("The disk haven't been mounted!\n");
 		return -1;
 	}
-	// search through the top 10% blocks finding the first avalible inode
-	union fs_block block;
-	disk_read(0, block.data);
-	for(int i = 0; i < block.super.ninodeblocks; i++){
-		union fs_block tempblock;
-		disk_read(i+1, tempblock.data);
-		for(int j = 0; j < INODES_PER_BLOCK; j++){
-			if(tempblock.inode[j].isvalid == 0){
-				tempblock.inode[j].isvalid = 1;
-				tempblock.inode[j].size = 0;
-				disk_write(i+1, tempblock.data);
-				disk_write(0, block.data);
-				printf("create with an inumber of : %d", i*INODES_PER_BLOCK + j + 1);
-				return i * INODES_PER_BLOCK + j + 1;
-			}
+	int inumber = inode_alloc(group_roomy());
+	if(inumber != -1)
+		printf("create with an inumber of : %d", inumber);
+	return inumber;
+}
+
+static int compare_blocknum(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+//hand freed data blocks back to the host image, merging neighbours into
+//one punch per contiguous run instead of one call per block. a block that
+//was allocated again after it was queued holds live data by now, and is
+//left alone
+static void discard_blocks(int *blocks, int nfreed)
+{
+	int start = 0;
+	int count = 0;
+	qsort(blocks, nfreed, sizeof(int), compare_blocknum);
+	for(int i = 0; i < nfreed; i++){
+		if(bitmap[blocks[i]] != FREE || (count && blocks[i] < start + count))
+			continue;
+		if(count && blocks[i] == start + count){
+			count++;
+			continue;
 		}
+		if(count)
+			disk_discard(start, count);
+		start = blocks[i];
+		count = 1;
+	}
+	if(count)
+		disk_discard(start, count);
+}
+
+//drop one reference to a block, queueing it for discard once nothing uses it
+static void release_block(int blocknum, int *freed, int *nfreed)
+{
+	if(bitmap[blocknum] > TAKEN){
+		bitmap[blocknum]--;
+	}else if(bitmap[blocknum] == TAKEN){
+		free_block(blocknum);
+		freed[(*nfreed)++] = blocknum;
 	}
-	return -1;
 }
 
 int fs_delete(int inumber)
@@ -232,21 +594,36 @@ int fs_delete(int inumber)
 	disk_read(blocknum, block.data);
 	struct fs_inode inode = block.inode[inodenum];
 
+	if(inode.isvalid & INODE_SYSTEM){
+		printf("inode %d is reserved!\n", inumber);
+		return 0;
+	}
+	if(inode.isvalid & INODE_DIR){
+		printf("inode %d is a directory, unlink it by name\n", inumber);
+		return 0;
+	}
+	if(inode.isvalid & INODE_NAMED){
+		printf("inode %d has a name, unlink it by name\n", inumber);
+		return 0;
+	}
 	if(inode.isvalid){
-		int fileblocks = inode.size/BLOCK_SIZE + ((inode.size%BLOCK_SIZE == 0)?0:1);
+		int firstdata = superblock.super.ninodeblocks + 1;
+		int freed[POINTERS_PER_INODE + POINTERS_PER_BLOCK + 1];
+		int nfreed = 0;
 		for(int i = 0; i < POINTERS_PER_INODE; i++){
-			if(inode.direct[i] == 0)
+			if(inode.direct[i] < firstdata || inode.direct[i] >= superblock.super.nblocks)
 				continue;
-			bitmap[inode.direct[i]] = FREE;
+			release_block(inode.direct[i], freed, &nfreed);
 		}
-		if(fileblocks > POINTERS_PER_INODE){
+		if(inode.indirect >= firstdata && inode.indirect < superblock.super.nblocks){
 			union fs_block datablock;
 			disk_read(inode.indirect, datablock.data);
-			for(int k = 0; k < (fileblocks - POINTERS_PER_INODE); k++){
-				if(inode.direct[k] == 0)
+			for(int k = 0; k < POINTERS_PER_BLOCK; k++){
+				if(datablock.pointers[k] < firstdata || datablock.pointers[k] >= superblock.super.nblocks)
 					continue;
-				bitmap[datablock.pointers[k]] = FREE;
+				release_block(datablock.pointers[k], freed, &nfreed);
 			}
+			release_block(inode.indirect, freed, &nfreed);
 		}
 		block.inode[inodenum].isvalid = 0;
 		block.inode[inodenum].size = 0;
@@ -254,6 +631,9 @@ int fs_delete(int inumber)
 		block.inode[inodenum].indirect = 0;
 		disk_write(blocknum, block.data);
 		disk_write(0, superblock.data);
+		if(dedup_slot)
+			dedup_flush();
+		discard_blocks(freed, nfreed);
 	}
 	return 1;
 }
@@ -283,253 +663,2003 @@ int fs_getsize( int inumber )
 }
 
 
-int fs_read( int inumber, char *data, int length, int offset )
-{	
-	if(bitmap == NULL){
-		printf("The disk haven't been mounted!\n");
-		return -1;
-	}
-	union fs_block superblock;
-	disk_read(0, superblock.data);	
-	if(inumber > superblock.super.ninodes || inumber == 0){
-		printf("The inumber is invalid!\n");
-		return 0;
-	}
-	int blocknum = (inumber - 1) /INODES_PER_BLOCK + 1;
-	int inodenum = (inumber - 1) %INODES_PER_BLOCK;
-	union fs_block block;
+//the group holding block blocknum, or inode block blocknum when inodes is set
+static int group_find(int blocknum, int inodes)
+{
+	int g = 0;
+	while(g + 1 < ngroups && blocknum >= (inodes ? groups[g + 1].firstinode : groups[g + 1].first))
+		g++;
+	return g;
+}
 
+static int block_group(int blocknum)
+{
+	return group_find(blocknum, 0);
+}
 
+static int inode_group(int inumber)
+{
+	return group_find((inumber - 1) / INODES_PER_BLOCK + 1, 1);
+}
 
-	disk_read(0,block.data);
-	if(block.super.magic == FS_MAGIC){
-		union fs_block block;
-		disk_read(blocknum, block.data);
-		struct fs_inode inode = block.inode[inodenum];
-		if(inode.isvalid){
-			//check if input is valid
-			if(inode.size < offset) 
-				return 0;
-			int copysize = (inode.size - offset  < length) ? inode.size - offset : length;
-			if(copysize > 0){
-				union fs_block indirect;
-				disk_read(inode.indirect, indirect.data);
-				int blockbegin = offset / BLOCK_SIZE;
-				int blockoffset = offset % BLOCK_SIZE;
-				int datablocknum = (copysize > (BLOCK_SIZE - offset)) ? (copysize - (BLOCK_SIZE - blockoffset)) / BLOCK_SIZE : 0;
-				int first_length = (copysize > BLOCK_SIZE - blockoffset) ? BLOCK_SIZE - blockoffset : copysize;	
-				int last = (copysize > first_length)?(copysize - first_length) % BLOCK_SIZE : 0;
-
-				//copy the first number
-				//printf("length %d \t offset %d \t copysize %d, \tfirst length %d \t last %d\n", length, offset, copysize, first_length, last);
-				union fs_block datablock;
-				if(blockbegin < POINTERS_PER_INODE){
-					disk_read(inode.direct[blockbegin], datablock.data);
-				}
-				else{
-					int tempblocknum = indirect.pointers[blockbegin - POINTERS_PER_INODE];
-					disk_read(tempblocknum, datablock.data);
-				}
-				memcpy(data, datablock.data, first_length);
-			
-				//printf("first block complete, datablock number:%d\n", datablocknum);
-				//copy rest blocks
-				for(int i = 1; i <= datablocknum; i++){
-					union fs_block tempblock;
-					if(blockbegin + i < POINTERS_PER_INODE){
-						disk_read(inode.direct[blockbegin + i], tempblock.data);
-					}else{
-						int tempblocknum = indirect.pointers[blockbegin + i - POINTERS_PER_INODE];
-						disk_read(tempblocknum, tempblock.data);
-					}
-					memcpy(data + first_length + BLOCK_SIZE * (i-1), tempblock.data, BLOCK_SIZE);
-				}
+//split the inode table and the data region evenly between the groups
+//recorded at format time, and count each group's free blocks
+static void group_setup(struct fs_superblock *super)
+{
+	int firstdata = super->ninodeblocks + 1;
+	int ndata = super->nblocks - firstdata;
+	//images from before groups may hold anything in this field
+	ngroups = super->ngroups;
+	if(ngroups > super->ninodeblocks)
+		ngroups = super->ninodeblocks;
+	if(ngroups < 1)
+		ngroups = 1;
+	groups = calloc(ngroups, sizeof(struct fs_group));
+	for(int g = 0; g < ngroups; g++){
+		struct fs_group *group = &groups[g];
+		pthread_mutex_init(&group->lock, NULL);
+		group->firstinode = 1 + (long long)g * super->ninodeblocks / ngroups;
+		group->lastinode = 1 + (long long)(g + 1) * super->ninodeblocks / ngroups;
+		group->first = firstdata + (long long)g * ndata / ngroups;
+		group->last = firstdata + (long long)(g + 1) * ndata / ngroups;
+		group->nfree = 0;
+		for(int b = group->first; b < group->last; b++){
+			if(bitmap[b] == FREE)
+				group->nfree++;
+		}
+	}
+}
 
-				if(last != 0){
-					//printf("copy last block\n");
-					union fs_block tempblock;
-					if(blockbegin + datablocknum + 1 < POINTERS_PER_INODE){
-						disk_read(inode.direct[blockbegin + datablocknum + 1], tempblock.data);
-					}else{
-						int tempblocknum = indirect.pointers[blockbegin + datablocknum + 1 - POINTERS_PER_INODE];
-						disk_read(tempblocknum, tempblock.data);
-					}
-					memcpy(data + first_length + BLOCK_SIZE * datablocknum, tempblock.data, BLOCK_SIZE);
-					//printf("last block copy complete\n");
-				}
-			}
-			return copysize;
+//the first group with at least the average number of free blocks, where
+//new directories and unrelated files start out. a fresh image fills from
+//group 0, and a group only passes new files on once it is fuller than
+//the rest
+static int group_roomy()
+{
+	long long total = 0;
+	int *nfree = malloc(ngroups * sizeof(int));
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_lock(&groups[g].lock);
+		nfree[g] = groups[g].nfree;
+		pthread_mutex_unlock(&groups[g].lock);
+		total += nfree[g];
+	}
+	int best = 0;
+	for(int g = 0; g < ngroups; g++){
+		if((long long)nfree[g] * ngroups >= total){
+			best = g;
+			break;
 		}
 	}
-	return 0;
+	free(nfree);
+	return best;
 }
 
-int findFree(){
+//the free counts after the bitmap was changed wholesale
+static void group_count()
+{
+	for(int g = 0; g < ngroups; g++){
+		groups[g].nfree = 0;
+		for(int b = groups[g].first; b < groups[g].last; b++){
+			if(bitmap[b] == FREE)
+				groups[g].nfree++;
+		}
+	}
+}
+
+//first free block of group g at or after goal, wrapping around to the
+//start of the group. the caller holds the group's lock
+static int group_scan(struct fs_group *group, int goal)
+{
+	if(goal < group->first || goal >= group->last)
+		goal = group->first;
+	for(int b = goal; b < group->last; b++){
+		if(bitmap[b] == FREE)
+			return b;
+	}
+	for(int b = group->first; b < goal; b++){
+		if(bitmap[b] == FREE)
+			return b;
+	}
+	return -1;
+}
+
+//take a free block as close to goal as possible: in goal's own group if it
+//has room, otherwise in the groups after it
+static int alloc_block(int goal)
+{
 	if(bitmap == NULL){
 		printf("The disk haven't been mounted!\n");
 		return -1;
 	}
-	union fs_block block;
-	disk_read(0, block.data);
-	int nblocks = block.super.nblocks;
-	int inodesblocks = block.super.ninodeblocks;
-	for(int i = inodesblocks; i < nblocks; i++){
-		if(bitmap[i] == FREE){
-			return i;
+	int start = block_group(goal);
+	for(int i = 0; i < ngroups; i++){
+		struct fs_group *group = &groups[(start + i) % ngroups];
+		pthread_mutex_lock(&group->lock);
+		int blocknum = (group->nfree > 0) ? group_scan(group, i ? group->first : goal) : -1;
+		if(blocknum != -1){
+			bitmap[blocknum] = TAKEN;
+			group->nfree--;
+		}
+		pthread_mutex_unlock(&group->lock);
+		if(blocknum != -1)
+			return blocknum;
+	}
+	return -1;
+}
+
+//take count contiguous free blocks inside a single group, trying goal's
+//group first. returns the first block of the run, or -1 if no group has one
+static int alloc_run(int goal, int count)
+{
+	if(count <= 0)
+		return -1;
+	int start = block_group(goal);
+	for(int i = 0; i < ngroups; i++){
+		struct fs_group *group = &groups[(start + i) % ngroups];
+		pthread_mutex_lock(&group->lock);
+		int found = -1;
+		int run = 0;
+		for(int b = group->first; group->nfree >= count && b < group->last; b++){
+			run = (bitmap[b] == FREE) ? run + 1 : 0;
+			if(run == count){
+				found = b - count + 1;
+				break;
+			}
+		}
+		if(found != -1){
+			for(int b = found; b < found + count; b++)
+				bitmap[b] = TAKEN;
+			group->nfree -= count;
 		}
+		pthread_mutex_unlock(&group->lock);
+		if(found != -1)
+			return found;
 	}
 	return -1;
 }
 
+//drop the last reference to a block
+static void free_block(int blocknum)
+{
+	struct fs_group *group = &groups[block_group(blocknum)];
+	pthread_mutex_lock(&group->lock);
+	if(bitmap[blocknum] != FREE){
+		bitmap[blocknum] = FREE;
+		group->nfree++;
+	}
+	pthread_mutex_unlock(&group->lock);
+	dedup_forget(blocknum);
+}
 
-int fs_write( int inumber, const char *data, int length, int offset )
+//in-memory copy of an inode and its indirect block, so the read and write
+//paths can walk logical blocks without going back to disk for every pointer
+struct fs_filemap {
+	int inumber;
+	struct fs_inode inode;
+	union fs_block indirect;
+	int inode_dirty;
+	int indirect_dirty;
+};
+
+//returns -1 when not mounted, 0 for a bad or free inumber, 1 on success
+static int map_open(struct fs_filemap *map, int inumber)
 {
-	printf("enter write\n");
-	printf("length %d, /t offset %d\n", length, offset);
 	if(bitmap == NULL){
 		printf("The disk haven't been mounted!\n");
 		return -1;
 	}
-	union fs_block superblock;
-	disk_read(0, superblock.data);	
-	if(inumber > superblock.super.ninodes || inumber == 0){
+	union fs_block block;
+	disk_read(0, block.data);
+	if(block.super.magic != FS_MAGIC || inumber > block.super.ninodes || inumber <= 0){
 		printf("The inumber is invalid!\n");
 		return 0;
 	}
+	disk_read((inumber - 1) / INODES_PER_BLOCK + 1, block.data);
+	map->inumber = inumber;
+	map->inode = block.inode[(inumber - 1) % INODES_PER_BLOCK];
+	map->inode_dirty = 0;
+	map->indirect_dirty = 0;
+	if(!map->inode.isvalid){
+		printf("inumber is not valid. Not create yet.\n");
+		return 0;
+	}
+	if(map->inode.indirect){
+		disk_read(map->inode.indirect, map->indirect.data);
+	}else{
+		memset(map->indirect.data, 0, sizeof(map->indirect.data));
+	}
+	return 1;
+}
 
-	int blocknum = (inumber - 1) /INODES_PER_BLOCK + 1;
-	int inodenum = (inumber - 1) %INODES_PER_BLOCK;
-	union fs_block block;
-	int ret = 0;
+//physical block behind logical block n, or 0 for a hole
+static int map_get(struct fs_filemap *map, int n)
+{
+	if(n < POINTERS_PER_INODE)
+		return map->inode.direct[n];
+	if(n >= MAX_FILE_BLOCKS || !map->inode.indirect)
+		return 0;
+	return map->indirect.pointers[n - POINTERS_PER_INODE];
+}
 
-	disk_read(0,block.data);
-	if(block.super.magic == FS_MAGIC){
-		union fs_block block;
-		disk_read(blocknum, block.data);
-		struct fs_inode inode = block.inode[inodenum];
-		if(inode.isvalid){
-			//check the input
-			if(inode.size < offset)
-				return ret;
-			int blockbegin = offset / BLOCK_SIZE;
-			int blockoffset = offset % BLOCK_SIZE;
-			int datablocknum = (length > (BLOCK_SIZE - offset))?(length - (BLOCK_SIZE - blockoffset)) / BLOCK_SIZE : 0;
-			int first_length = (length > BLOCK_SIZE - blockoffset) ? BLOCK_SIZE - blockoffset : length;	
-			int last = (first_length < length)?(length - first_length) % BLOCK_SIZE : 0;
-	
-			int directblocknum = datablocknum + blockbegin + 1;
-			for(int i = 0; i < directblocknum; i++){
-				if(inode.direct[i] != 0)
-					continue;
-				int freeblock = findFree();
-				if(freeblock != -1){
-					bitmap[freeblock] = TAKEN;
-					inode.direct[i] = freeblock;
-				}
-			}
-			
-			int extrablock = datablocknum + blockbegin + 1 - POINTERS_PER_INODE;
-			// allocate indirect pointer
-			if(extrablock > 0 && inode.indirect == 0){
-				int freeblock = findFree();
-				if(freeblock != -1){
-					bitmap[freeblock] = TAKEN;
-					inode.indirect = freeblock;
-				}
-			}
-			if(extrablock > 0){
-				union fs_block indirect;
-				disk_read(inode.indirect, indirect.data);
-				// allocate space for data
-				for(int k = 0; k < extrablock; k++){
-					if(indirect.pointers[k] != 0)
-						continue;
-					int tempfree = findFree();
-					if(tempfree != -1){
-						bitmap[tempfree] = TAKEN;
-						indirect.pointers[k] = tempfree;
-					}else{
-						indirect.pointers[k] = 0;
-					}
-				}
-				disk_write(inode.indirect, indirect.data);
-			}
-			
-			block.inode[inodenum] = inode;
-			disk_write(blocknum, block.data);
+//where block n of a file should go: just past the nearest mapped block
+//before it, or at the start of the inode's group for a file's first block
+static int map_goal(struct fs_filemap *map, int n)
+{
+	for(int k = n - 1; k >= 0; k--){
+		int blocknum = map_get(map, k);
+		if(blocknum)
+			return blocknum + (n - k);
+	}
+	return groups[inode_group(map->inumber)].first;
+}
 
-			//write the first block
-			union fs_block indirect;
-			disk_read(inode.indirect, indirect.data);
-			union fs_block datablock;
-			int tempblocknum;
-			if(blockbegin > POINTERS_PER_INODE){
-				tempblocknum = indirect.pointers[blockbegin - POINTERS_PER_INODE];
-			}else{
-				tempblocknum = inode.direct[blockbegin];
-			}
+//make sure logical block n has somewhere to store its pointer. an indirect
+//block shared with a clone is copied first; the data blocks it points at
+//are already counted once per file, so their counts stay as they are
+static int map_reserve(struct fs_filemap *map, int n)
+{
+	if(n >= MAX_FILE_BLOCKS)
+		return 0;
+	if(n < POINTERS_PER_INODE)
+		return 1;
+	if(map->inode.indirect && bitmap[map->inode.indirect] == TAKEN)
+		return 1;
+	int freeblock = alloc_block(map_goal(map, POINTERS_PER_INODE));
+	if(freeblock == -1)
+		return 0;
+	if(map->inode.indirect){
+		bitmap[map->inode.indirect]--;
+	}else{
+		memset(map->indirect.data, 0, sizeof(map->indirect.data));
+	}
+	map->inode.indirect = freeblock;
+	map->inode_dirty = 1;
+	map->indirect_dirty = 1;
+	return 1;
+}
 
-			if(tempblocknum == 0){
-				block.inode[inodenum].size += ret;
-				disk_write(blocknum, block.data);
-				return ret;
-			}
-			
-			disk_read(tempblocknum, datablock.data);
-			memcpy(datablock.data + blockoffset, data, first_length);
-			disk_write(inode.direct[blockbegin], datablock.data);
-			ret += first_length;
-
-			//write the rest block
-			for(int i = 1; i <= datablocknum; i++){
-				if(blockbegin + i < POINTERS_PER_INODE){
-					if(inode.direct[blockbegin + i] == 0){
-						block.inode[inodenum].size += ret;
-						disk_write(blocknum, block.data);
-						return ret;
-					}
-					disk_write(inode.direct[blockbegin + i], data+first_length + BLOCK_SIZE*(i-1));
-				}else{
-					int tempblocknum = indirect.pointers[blockbegin + i - POINTERS_PER_INODE];
-					if(tempblocknum == 0){
-						block.inode[inodenum].size += ret;
-						disk_write(blocknum, block.data);
-						return ret;
-					}
-					disk_write(tempblocknum, data + first_length + BLOCK_SIZE*(i-1));
-				}
-				ret += BLOCK_SIZE;
-			}
-			
-			if(last != 0){
-				union fs_block tempblock;
-				
-				if(blockbegin + datablocknum < POINTERS_PER_INODE){
-					if(inode.direct[blockbegin + datablocknum] == 0){
-						block.inode[inodenum].size += ret;
-						disk_write(blocknum, block.data);
-						return ret;
-					}
-					disk_read(inode.direct[blockbegin+datablocknum], tempblock.data);
-					memcpy(tempblock.data, data + first_length + BLOCK_SIZE * datablocknum, last);
-					disk_write(inode.direct[blockbegin + datablocknum], tempblock.data);
-				}else{
-					int tempblocknum = indirect.pointers[blockbegin + datablocknum - POINTERS_PER_INODE];
-					if(tempblocknum == 0){
-						block.inode[inodenum].size += ret;
-						disk_write(blocknum, block.data);
-						return ret;
-					}
-					memcpy(tempblock.data, data + first_length + BLOCK_SIZE * datablocknum, last);
-					disk_write(tempblocknum, tempblock.data);
-				}
-				ret += last;
-				
-			}
-			block.inode[inodenum].size += ret;
-			disk_write(blocknum, block.data);
+static int map_set(struct fs_filemap *map, int n, int blocknum)
+{
+	if(!map_reserve(map, n))
+		return 0;
+	if(n < POINTERS_PER_INODE){
+		map->inode.direct[n] = blocknum;
+		map->inode_dirty = 1;
+	}else{
+		map->indirect.pointers[n - POINTERS_PER_INODE] = blocknum;
+		map->indirect_dirty = 1;
+	}
+	return 1;
+}
 
-		}
+//write back whatever changed since map_open
+static void map_close(struct fs_filemap *map)
+{
+	if(map->indirect_dirty){
+		disk_write(map->inode.indirect, map->indirect.data);
 	}
-	return ret;
+	if(map->inode_dirty){
+		int blocknum = (map->inumber - 1) / INODES_PER_BLOCK + 1;
+		union fs_block block;
+		disk_read(blocknum, block.data);
+		block.inode[(map->inumber - 1) % INODES_PER_BLOCK] = map->inode;
+		disk_write(blocknum, block.data);
+	}
+}
+
+//switch an empty file over to compressed storage
+int fs_compress( int inumber )
+{
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0)
+		return 0;
+	if(map.inode.size != 0){
+		printf("inode %d already holds data, compress it before the first write\n", inumber);
+		return 0;
+	}
+	if(map.inode.isvalid & (INODE_DEDUP | INODE_SYSTEM | INODE_DIR)){
+		printf("inode %d can't be compressed\n", inumber);
+		return 0;
+	}
+	map.inode.isvalid |= INODE_COMPRESSED;
+	map.inode_dirty = 1;
+	map_close(&map);
+	return 1;
+}
+
+//make a new inode that shares every block of inumber. nothing is copied
+//until one of the two files is written
+int fs_clone( int inumber )
+{
+	struct fs_filemap src;
+	if(map_open(&src, inumber) <= 0)
+		return -1;
+	if(src.inode.isvalid & (INODE_SYSTEM | INODE_DIR)){
+		printf("inode %d can't be cloned\n", inumber);
+		return -1;
+	}
+	//next to the original, whose blocks it shares until either is written
+	int clone = inode_alloc(inode_group(inumber));
+	if(clone == -1)
+		return -1;
+
+	for(int k = 0; k < POINTERS_PER_INODE; k++){
+		if(src.inode.direct[k])
+			bitmap[src.inode.direct[k]]++;
+	}
+	if(src.inode.indirect){
+		bitmap[src.inode.indirect]++;
+		for(int k = 0; k < POINTERS_PER_BLOCK; k++){
+			if(src.indirect.pointers[k])
+				bitmap[src.indirect.pointers[k]]++;
+		}
+	}
+
+	struct fs_filemap dst;
+	dst.inumber = clone;
+	dst.inode = src.inode;
+	dst.inode.isvalid &= ~INODE_NAMED;
+	dst.inode_dirty = 1;
+	dst.indirect_dirty = 0;
+	map_close(&dst);
+	return clone;
+}
+
+//inflate cluster c into buf, which must hold CLUSTER_SIZE bytes
+static int cluster_load(struct fs_filemap *map, int c, char *buf)
+{
+	char packed[CLUSTER_SIZE];
+	int nslots = 0;
+	while(nslots < CLUSTER_BLOCKS && map_get(map, c * CLUSTER_BLOCKS + nslots) != 0)
+		nslots++;
+
+	if(nslots == 0){
+		memset(buf, 0, CLUSTER_SIZE);
+		return 1;
+	}
+	char *dst = (nslots == CLUSTER_BLOCKS) ? buf : packed;
+	for(int i = 0; i < nslots; i++){
+		disk_read(map_get(map, c * CLUSTER_BLOCKS + i), dst + i * BLOCK_SIZE);
+	}
+	if(nslots == CLUSTER_BLOCKS)
+		return 1;
+
+	int clen;
+	memcpy(&clen, packed, sizeof(clen));
+	int n = -1;
+	if(clen > 0 && clen <= nslots * BLOCK_SIZE - (int)sizeof(clen))
+		n = lz_decompress(packed + sizeof(clen), clen, buf, CLUSTER_SIZE);
+	if(n < 0){
+		printf("ERROR: cluster %d of inode %d is corrupt\n", c, map->inumber);
+		return 0;
+	}
+	memset(buf + n, 0, CLUSTER_SIZE - n);
+	return 1;
+}
+
+//deflate buf into cluster c, growing or shrinking the blocks it occupies.
+//blocks it no longer needs are appended to freed for the caller to discard
+static int cluster_store(struct fs_filemap *map, int c, const char *buf, int *freed, int *nfreed)
+{
+	char packed[CLUSTER_SIZE];
+	int clen = 0;
+	int need = 0;
+	int i;
+
+	for(i = 0; i < CLUSTER_SIZE; i++){
+		if(buf[i] != 0)
+			break;
+	}
+	if(i < CLUSTER_SIZE){
+		clen = lz_compress(buf, CLUSTER_SIZE, packed + sizeof(clen), (CLUSTER_BLOCKS - 1) * BLOCK_SIZE - sizeof(clen));
+		if(clen > 0){
+			memcpy(packed, &clen, sizeof(clen));
+			need = (sizeof(clen) + clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			memset(packed + sizeof(clen) + clen, 0, need * BLOCK_SIZE - sizeof(clen) - clen);
+		}else{
+			need = CLUSTER_BLOCKS;
+		}
+	}
+
+	//grab any new blocks up front so a full disk leaves the old cluster intact.
+	//a block someone else also references is never written in place
+	int old[CLUSTER_BLOCKS];
+	int slots[CLUSTER_BLOCKS];
+	int fresh = 0;
+	if(need > 0 && !map_reserve(map, c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1))
+		return 0;
+	for(i = 0; i < CLUSTER_BLOCKS; i++){
+		old[i] = slots[i] = map_get(map, c * CLUSTER_BLOCKS + i);
+		if(i < need && (slots[i] == 0 || bitmap[slots[i]] > TAKEN)){
+			slots[i] = alloc_block(map_goal(map, c * CLUSTER_BLOCKS + i));
+			if(slots[i] == -1){
+				for(int k = 0; k < i; k++){
+					if(fresh & (1 << k))
+						free_block(slots[k]);
+				}
+				return 0;
+			}
+			fresh |= 1 << i;
+		}
+	}
+
+	const char *src = (need == CLUSTER_BLOCKS) ? buf : packed;
+	for(i = 0; i < CLUSTER_BLOCKS; i++){
+		if(i < need){
+			disk_write(slots[i], src + i * BLOCK_SIZE);
+			if(fresh & (1 << i)){
+				map_set(map, c * CLUSTER_BLOCKS + i, slots[i]);
+				if(old[i])
+					release_block(old[i], freed, nfreed);
+			}
+		}else if(slots[i] != 0){
+			release_block(slots[i], freed, nfreed);
+			map_set(map, c * CLUSTER_BLOCKS + i, 0);
+		}
+	}
+	return 1;
+}
+
+static int read_compressed(struct fs_filemap *map, char *data, int length, int offset)
+{
+	char buf[CLUSTER_SIZE];
+	int done = 0;
+	while(done < length){
+		int c = (offset + done) / CLUSTER_SIZE;
+		int clusteroffset = (offset + done) % CLUSTER_SIZE;
+		int chunk = CLUSTER_SIZE - clusteroffset;
+		if(chunk > length - done)
+			chunk = length - done;
+		if(!cluster_load(map, c, buf))
+			break;
+		memcpy(data + done, buf + clusteroffset, chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+static int write_compressed(struct fs_filemap *map, const char *data, int length, int offset)
+{
+	char buf[CLUSTER_SIZE];
+	int freed[MAX_FILE_BLOCKS];
+	int nfreed = 0;
+	int done = 0;
+	while(done < length){
+		int c = (offset + done) / CLUSTER_SIZE;
+		int clusteroffset = (offset + done) % CLUSTER_SIZE;
+		int chunk = CLUSTER_SIZE - clusteroffset;
+		if(chunk > length - done)
+			chunk = length - done;
+		if(c >= MAX_FILE_CLUSTERS)
+			break;
+		//a whole-cluster write doesn't need the old contents
+		if(chunk < CLUSTER_SIZE && !cluster_load(map, c, buf))
+			break;
+		memcpy(buf + clusteroffset, data + done, chunk);
+		if(!cluster_store(map, c, buf, freed, &nfreed))
+			break;
+		done += chunk;
+	}
+	discard_blocks(freed, nfreed);
+	return done;
+}
+
+//xxhash32-style hash over four independent lanes, so the inner loop has
+//no cross-lane dependency and vectorizes cleanly
+static unsigned rotl32(unsigned v, int r)
+{
+	return (v << r) | (v >> (32 - r));
+}
+
+static unsigned block_hash(const char *data)
+{
+	const unsigned P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u;
+	unsigned lane[4] = { P1 + P2, P2, 0, 0 - P1 };
+	for(int i = 0; i < BLOCK_SIZE; i += sizeof(lane)){
+		unsigned stripe[4];
+		memcpy(stripe, data + i, sizeof(stripe));
+		for(int k = 0; k < 4; k++){
+			lane[k] = rotl32(lane[k] + stripe[k] * P2, 13) * P1;
+		}
+	}
+	unsigned h = rotl32(lane[0], 1) + rotl32(lane[1], 7) + rotl32(lane[2], 12) + rotl32(lane[3], 18);
+	h ^= h >> 15;
+	h *= P2;
+	h ^= h >> 13;
+	h *= P3;
+	h ^= h >> 16;
+	return h;
+}
+
+static int dedup_nslots()
+{
+	return dedup_nblocks * DEDUP_ENTRIES_PER_BLOCK;
+}
+
+//read the index named by the superblock into memory
+static void dedup_load()
+{
+	union fs_block block;
+	disk_read(0, block.data);
+	int nblocks = block.super.nblocks;
+	int inumber = block.super.dedupinode;
+	if(inumber <= 0 || inumber > block.super.ninodes)
+		return;
+	disk_read((inumber - 1) / INODES_PER_BLOCK + 1, block.data);
+	struct fs_inode inode = block.inode[(inumber - 1) % INODES_PER_BLOCK];
+	if(!(inode.isvalid & INODE_SYSTEM))
+		return;
+
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0)
+		return;
+	dedup_nblocks = map.inode.size / BLOCK_SIZE;
+	dedup_index = malloc(dedup_nblocks * BLOCK_SIZE);
+	dedup_blocks = malloc(dedup_nblocks * sizeof(int));
+	dedup_dirty = calloc(dedup_nblocks, 1);
+	for(int i = 0; i < dedup_nblocks; i++){
+		dedup_blocks[i] = map_get(&map, i);
+		disk_read(dedup_blocks[i], (char *)dedup_index + i * BLOCK_SIZE);
+	}
+	dedup_slot = calloc(nblocks, sizeof(int));
+	dedup_prune(nblocks);
+}
+
+//set up an empty index in a new system inode
+static int dedup_create()
+{
+	union fs_block block;
+	disk_read(0, block.data);
+	int nblocks = (block.super.nblocks + DEDUP_ENTRIES_PER_BLOCK - 1) / DEDUP_ENTRIES_PER_BLOCK;
+	if(nblocks > MAX_FILE_BLOCKS)
+		nblocks = MAX_FILE_BLOCKS;
+
+	int inumber = inode_alloc(group_roomy());
+	if(inumber == -1)
+		return 0;
+	struct fs_filemap map;
+	map_open(&map, inumber);
+
+	dedup_index = calloc(nblocks, BLOCK_SIZE);
+	dedup_blocks = malloc(nblocks * sizeof(int));
+	dedup_dirty = calloc(nblocks, 1);
+	for(dedup_nblocks = 0; dedup_nblocks < nblocks; dedup_nblocks++){
+		int blocknum = alloc_block(map_goal(&map, dedup_nblocks));
+		if(blocknum == -1)
+			break;
+		if(!map_set(&map, dedup_nblocks, blocknum)){
+			free_block(blocknum);
+			break;
+		}
+		dedup_blocks[dedup_nblocks] = blocknum;
+		disk_write(blocknum, (char *)dedup_index + dedup_nblocks * BLOCK_SIZE);
+	}
+	map.inode.size = dedup_nblocks * BLOCK_SIZE;
+	if(dedup_nblocks < nblocks){
+		printf("not enough free blocks for the dedup index\n");
+		map_close(&map);
+		fs_delete(inumber);
+		free(dedup_index);
+		free(dedup_blocks);
+		free(dedup_dirty);
+		dedup_index = NULL;
+		dedup_nblocks = 0;
+		return 0;
+	}
+	map.inode.isvalid |= INODE_SYSTEM;
+	map.inode_dirty = 1;
+	map_close(&map);
+	dedup_slot = calloc(block.super.nblocks, sizeof(int));
+
+	disk_read(0, block.data);
+	block.super.dedupinode = inumber;
+	disk_write(0, block.data);
+	return 1;
+}
+
+//a block already on disk with exactly these contents, or 0
+static int dedup_lookup(unsigned hash, const char *data)
+{
+	union fs_block candidate;
+	for(int p = 0; p < DEDUP_PROBES; p++){
+		struct dedup_entry *entry = &dedup_index[(hash + p) % dedup_nslots()];
+		if(entry->blocknum == 0 || entry->hash != hash || bitmap[entry->blocknum] == FREE)
+			continue;
+		//the index is only a hint: slots get overwritten and blocks get
+		//reused, so confirm the bytes before sharing anything
+		disk_read(entry->blocknum, candidate.data);
+		if(memcmp(candidate.data, data, BLOCK_SIZE) == 0)
+			return entry->blocknum;
+	}
+	return 0;
+}
+
+//take the first empty or stale slot within reach, else evict the home slot
+static void dedup_insert(unsigned hash, int blocknum)
+{
+	int slot = hash % dedup_nslots();
+	for(int p = 0; p < DEDUP_PROBES; p++){
+		int probe = (hash + p) % dedup_nslots();
+		struct dedup_entry *entry = &dedup_index[probe];
+		if(entry->blocknum == 0 || entry->blocknum == blocknum || bitmap[entry->blocknum] == FREE){
+			slot = probe;
+			break;
+		}
+	}
+	//a block keeps a single entry, the one for what it holds now
+	dedup_forget(blocknum);
+	if(dedup_index[slot].blocknum != 0)
+		dedup_slot[dedup_index[slot].blocknum] = 0;
+	dedup_index[slot].hash = hash;
+	dedup_index[slot].blocknum = blocknum;
+	dedup_dirty[slot / DEDUP_ENTRIES_PER_BLOCK] = 1;
+	dedup_slot[blocknum] = slot + 1;
+}
+
+//drop the index entry naming a block. called when its last reference
+//goes, so a freed block reused for a directory or any other file can
+//never be handed out as shared dedup data
+static void dedup_forget(int blocknum)
+{
+	if(dedup_slot == NULL || dedup_slot[blocknum] == 0)
+		return;
+	int slot = dedup_slot[blocknum] - 1;
+	dedup_index[slot].hash = 0;
+	dedup_index[slot].blocknum = 0;
+	dedup_dirty[slot / DEDUP_ENTRIES_PER_BLOCK] = 1;
+	dedup_slot[blocknum] = 0;
+}
+
+//rebuild the block to entry map, clearing entries that name free or out
+//of range blocks and all but one entry per block
+static void dedup_prune(int nblocks)
+{
+	memset(dedup_slot, 0, nblocks * sizeof(int));
+	for(int slot = 0; slot < dedup_nslots(); slot++){
+		struct dedup_entry *entry = &dedup_index[slot];
+		if(entry->blocknum == 0)
+			continue;
+		if(entry->blocknum < 0 || entry->blocknum >= nblocks || bitmap[entry->blocknum] == FREE
+		   || dedup_slot[entry->blocknum] != 0){
+			entry->hash = 0;
+			entry->blocknum = 0;
+			dedup_dirty[slot / DEDUP_ENTRIES_PER_BLOCK] = 1;
+			continue;
+		}
+		dedup_slot[entry->blocknum] = slot + 1;
+	}
+}
+
+//write the index blocks touched since the last flush back to disk
+static void dedup_flush()
+{
+	for(int i = 0; i < dedup_nblocks; i++){
+		if(!dedup_dirty[i])
+			continue;
+		disk_write(dedup_blocks[i], (char *)dedup_index + i * BLOCK_SIZE);
+		dedup_dirty[i] = 0;
+	}
+}
+
+//store new files in deduplicated form
+int fs_dedup( int inumber )
+{
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0)
+		return 0;
+	if(map.inode.size != 0){
+		printf("inode %d already holds data, dedup it before the first write\n", inumber);
+		return 0;
+	}
+	if(map.inode.isvalid & (INODE_COMPRESSED | INODE_SYSTEM | INODE_DIR)){
+		printf("inode %d can't be deduplicated\n", inumber);
+		return 0;
+	}
+	if(dedup_index == NULL && !dedup_create())
+		return 0;
+	map.inode.isvalid |= INODE_DEDUP;
+	map.inode_dirty = 1;
+	map_close(&map);
+	return 1;
+}
+
+//each block is looked up by content before it is written. a match just
+//gains a reference instead of costing a block and a write
+static int write_dedup(struct fs_filemap *map, const char *data, int length, int offset)
+{
+	union fs_block datablock;
+	int freed[MAX_FILE_BLOCKS];
+	int nfreed = 0;
+	int done = 0;
+	while(done < length){
+		int n = (offset + done) / BLOCK_SIZE;
+		int blockoffset = (offset + done) % BLOCK_SIZE;
+		int chunk = BLOCK_SIZE - blockoffset;
+		if(chunk > length - done)
+			chunk = length - done;
+		if(n >= MAX_FILE_BLOCKS)
+			break;
+
+		int old = map_get(map, n);
+		const char *src = data + done;
+		if(chunk < BLOCK_SIZE){
+			if(old == 0){
+				memset(datablock.data, 0, sizeof(datablock.data));
+			}else{
+				disk_read(old, datablock.data);
+			}
+			memcpy(datablock.data + blockoffset, data + done, chunk);
+			src = datablock.data;
+		}
+
+		unsigned hash = block_hash(src);
+		int blocknum = dedup_lookup(hash, src);
+		if(blocknum != 0 && blocknum == old){
+			done += chunk;
+			continue;
+		}
+		if(blocknum != 0){
+			if(!map_set(map, n, blocknum))
+				break;
+			bitmap[blocknum]++;
+		}else if(old != 0 && bitmap[old] == TAKEN){
+			disk_write(old, src);
+			dedup_insert(hash, old);
+			done += chunk;
+			continue;
+		}else{
+			blocknum = alloc_block(map_goal(map, n));
+			if(blocknum == -1)
+				break;
+			if(!map_set(map, n, blocknum)){
+				free_block(blocknum);
+				break;
+			}
+			disk_write(blocknum, src);
+			dedup_insert(hash, blocknum);
+		}
+		if(old != 0)
+			release_block(old, freed, &nfreed);
+		done += chunk;
+	}
+	discard_blocks(freed, nfreed);
+	dedup_flush();
+	return done;
+}
+
+int fs_read( int inumber, char *data, int length, int offset )
+{
+	struct fs_filemap map;
+	int ret = map_open(&map, inumber);
+	if(ret <= 0)
+		return ret;
+	if(offset < 0 || offset >= map.inode.size || length <= 0)
+		return 0;
+	if(length > map.inode.size - offset)
+		length = map.inode.size - offset;
+
+	if(map.inode.isvalid & INODE_COMPRESSED)
+		return read_compressed(&map, data, length, offset);
+
+	int done = 0;
+	while(done < length){
+		int blockoffset = (offset + done) % BLOCK_SIZE;
+		int chunk = BLOCK_SIZE - blockoffset;
+		if(chunk > length - done)
+			chunk = length - done;
+		int blocknum = map_get(&map, (offset + done) / BLOCK_SIZE);
+		if(blocknum == 0){
+			memset(data + done, 0, chunk);
+		}else if(chunk == BLOCK_SIZE){
+			disk_read(blocknum, data + done);
+		}else{
+			union fs_block datablock;
+			disk_read(blocknum, datablock.data);
+			memcpy(data + done, datablock.data + blockoffset, chunk);
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+	struct fs_filemap map;
+	int ret = map_open(&map, inumber);
+	if(ret <= 0)
+		return ret;
+	//writes may extend the file, but not start past its end
+	if(offset < 0 || offset > map.inode.size || length <= 0)
+		return 0;
+	if(map.inode.isvalid & (INODE_SYSTEM | INODE_DIR)){
+		printf("inode %d is reserved!\n", inumber);
+		return 0;
+	}
+
+	ret = 0;
+	if(map.inode.isvalid & INODE_COMPRESSED){
+		ret = write_compressed(&map, data, length, offset);
+	}else if(map.inode.isvalid & INODE_DEDUP){
+		ret = write_dedup(&map, data, length, offset);
+	}else{
+		while(ret < length){
+			int n = (offset + ret) / BLOCK_SIZE;
+			int blockoffset = (offset + ret) % BLOCK_SIZE;
+			int chunk = BLOCK_SIZE - blockoffset;
+			if(chunk > length - ret)
+				chunk = length - ret;
+			if(n >= MAX_FILE_BLOCKS)
+				break;
+			int old = map_get(&map, n);
+			int blocknum = old;
+			//a shared block is copied rather than written in place
+			if(old == 0 || bitmap[old] > TAKEN){
+				blocknum = alloc_block(map_goal(&map, n));
+				if(blocknum == -1)
+					break;
+				if(!map_set(&map, n, blocknum)){
+					free_block(blocknum);
+					break;
+				}
+			}
+			if(chunk == BLOCK_SIZE){
+				disk_write(blocknum, data + ret);
+			}else{
+				union fs_block datablock;
+				if(old == 0){
+					memset(datablock.data, 0, sizeof(datablock.data));
+				}else{
+					disk_read(old, datablock.data);
+				}
+				memcpy(datablock.data + blockoffset, data + ret, chunk);
+				disk_write(blocknum, datablock.data);
+			}
+			if(old != 0 && old != blocknum)
+				bitmap[old]--;
+			ret += chunk;
+		}
+	}
+
+	if(offset + ret > map.inode.size){
+		map.inode.size = offset + ret;
+		map.inode_dirty = 1;
+	}
+	map_close(&map);
+	return ret;
+}
+
+//FNV-1a over the name
+static unsigned name_hash(const char *name)
+{
+	unsigned h = 2166136261u;
+	while(*name){
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct dcache_entry *dcache_slot(int dir, const char *name)
+{
+	return &dcache[(name_hash(name) ^ (unsigned)dir * 2654435761u) % DCACHE_SIZE];
+}
+
+static int dcache_get(int dir, const char *name)
+{
+	struct dcache_entry *entry = dcache_slot(dir, name);
+	if(entry->inumber && entry->dir == dir && !strcmp(entry->name, name))
+		return entry->inumber;
+	return 0;
+}
+
+static void dcache_put(int dir, const char *name, int inumber)
+{
+	struct dcache_entry *entry = dcache_slot(dir, name);
+	entry->dir = dir;
+	entry->inumber = inumber;
+	strcpy(entry->name, name);
+}
+
+static void dcache_drop(int dir, const char *name)
+{
+	struct dcache_entry *entry = dcache_slot(dir, name);
+	if(entry->dir == dir && !strcmp(entry->name, name))
+		entry->inumber = 0;
+}
+
+//a new, empty directory with a single bucket
+static int dir_new()
+{
+	//directories spread out over the groups, and the files created in
+	//them follow into the same group
+	int inumber = inode_alloc(group_roomy());
+	if(inumber == -1)
+		return -1;
+	int blocknum = alloc_block(groups[inode_group(inumber)].first);
+	if(blocknum == -1){
+		fs_delete(inumber);
+		return -1;
+	}
+	union fs_block block;
+	memset(block.data, 0, sizeof(block.data));
+	disk_write(blocknum, block.data);
+
+	struct fs_filemap map;
+	map_open(&map, inumber);
+	map_set(&map, 0, blocknum);
+	map.inode.isvalid |= INODE_DIR;
+	map.inode.size = BLOCK_SIZE;
+	map_close(&map);
+	return inumber;
+}
+
+//the root directory, made the first time anyone asks for it
+static int dir_root()
+{
+	if(root_inumber)
+		return root_inumber;
+	if(bitmap == NULL){
+		printf("The disk haven't been mounted!\n");
+		return -1;
+	}
+	union fs_block block;
+	disk_read(0, block.data);
+	int inumber = block.super.rootinode;
+	if(inumber > 0 && inumber <= block.super.ninodes){
+		union fs_block inodes;
+		disk_read((inumber - 1) / INODES_PER_BLOCK + 1, inodes.data);
+		if(inodes.inode[(inumber - 1) % INODES_PER_BLOCK].isvalid & INODE_DIR){
+			root_inumber = inumber;
+			return root_inumber;
+		}
+	}
+	inumber = dir_new();
+	if(inumber == -1)
+		return -1;
+	disk_read(0, block.data);
+	block.super.rootinode = inumber;
+	disk_write(0, block.data);
+	root_inumber = inumber;
+	return root_inumber;
+}
+
+//bucket count of an open directory, or 0 if its bucket table is broken:
+//a count that isn't a power of two, or a hole fsck couldn't fill. a hole
+//would otherwise send the bucket reads and writes to block 0
+static int dir_buckets(struct fs_filemap *map)
+{
+	int nbuckets = map->inode.size / BLOCK_SIZE;
+	int broken = (nbuckets <= 0 || (nbuckets & (nbuckets - 1)) || nbuckets > MAX_FILE_BLOCKS);
+	for(int b = 0; !broken && b < nbuckets; b++){
+		if(map_get(map, b) == 0)
+			broken = 1;
+	}
+	if(broken){
+		printf("directory %d has a broken bucket table\n", map->inumber);
+		return 0;
+	}
+	return nbuckets;
+}
+
+//inumber of name in dir, 0 if it isn't there, -1 if dir isn't a usable
+//directory
+static int dir_find(int dir, const char *name)
+{
+	struct fs_filemap map;
+	if(map_open(&map, dir) <= 0)
+		return -1;
+	if(!(map.inode.isvalid & INODE_DIR)){
+		printf("inode %d is not a directory\n", dir);
+		return -1;
+	}
+	unsigned hash = name_hash(name);
+	int nbuckets = dir_buckets(&map);
+	if(nbuckets == 0)
+		return -1;
+	union fs_block bucket;
+	disk_read(map_get(&map, hash & (nbuckets - 1)), bucket.data);
+	for(int i = 0; i < DIRENTS_PER_BLOCK; i++){
+		struct fs_dirent *entry = &bucket.dirent[i];
+		if(entry->inumber && entry->hash == hash && !strcmp(entry->name, name))
+			return entry->inumber;
+	}
+	return 0;
+}
+
+static int dir_lookup(int dir, const char *name)
+{
+	int inumber = dcache_get(dir, name);
+	if(inumber)
+		return inumber;
+	inumber = dir_find(dir, name);
+	if(inumber > 0)
+		dcache_put(dir, name, inumber);
+	return inumber;
+}
+
+//double the bucket count. every entry of bucket b either stays or moves to
+//bucket b + nbuckets, depending on the next bit of its hash
+static int dir_grow(struct fs_filemap *map)
+{
+	int nbuckets = map->inode.size / BLOCK_SIZE;
+	int newblocks[MAX_FILE_BLOCKS];
+	int i;
+	if(2 * nbuckets > MAX_FILE_BLOCKS || !map_reserve(map, 2 * nbuckets - 1))
+		return 0;
+	for(i = 0; i < nbuckets; i++){
+		newblocks[i] = alloc_block(map_goal(map, nbuckets + i));
+		if(newblocks[i] == -1){
+			while(i-- > 0)
+				free_block(newblocks[i]);
+			return 0;
+		}
+	}
+	for(i = 0; i < nbuckets; i++){
+		union fs_block low, high;
+		int blocknum = map_get(map, i);
+		disk_read(blocknum, low.data);
+		memset(high.data, 0, sizeof(high.data));
+		for(int k = 0; k < DIRENTS_PER_BLOCK; k++){
+			if(low.dirent[k].inumber && (low.dirent[k].hash & nbuckets)){
+				high.dirent[k] = low.dirent[k];
+				low.dirent[k].inumber = 0;
+			}
+		}
+		disk_write(blocknum, low.data);
+		disk_write(newblocks[i], high.data);
+		map_set(map, nbuckets + i, newblocks[i]);
+	}
+	map->inode.size = 2 * nbuckets * BLOCK_SIZE;
+	map->inode_dirty = 1;
+	return 1;
+}
+
+static int dir_add(int dir, const char *name, int inumber)
+{
+	struct fs_filemap map;
+	if(map_open(&map, dir) <= 0)
+		return 0;
+	unsigned hash = name_hash(name);
+	while(1){
+		int nbuckets = dir_buckets(&map);
+		if(nbuckets == 0){
+			map_close(&map);
+			return 0;
+		}
+		int blocknum = map_get(&map, hash & (nbuckets - 1));
+		union fs_block bucket;
+		disk_read(blocknum, bucket.data);
+		int slot = -1;
+		for(int i = 0; i < DIRENTS_PER_BLOCK; i++){
+			struct fs_dirent *entry = &bucket.dirent[i];
+			if(!entry->inumber){
+				if(slot == -1)
+					slot = i;
+			}else if(entry->hash == hash && !strcmp(entry->name, name)){
+				printf("%s already exists\n", name);
+				map_close(&map);
+				return 0;
+			}
+		}
+		if(slot != -1){
+			bucket.dirent[slot].inumber = inumber;
+			bucket.dirent[slot].hash = hash;
+			strcpy(bucket.dirent[slot].name, name);
+			disk_write(blocknum, bucket.data);
+			map_close(&map);
+			dcache_put(dir, name, inumber);
+			return 1;
+		}
+		if(!dir_grow(&map)){
+			printf("directory %d is full\n", dir);
+			map_close(&map);
+			return 0;
+		}
+	}
+}
+
+static int dir_remove(int dir, const char *name)
+{
+	struct fs_filemap map;
+	if(map_open(&map, dir) <= 0)
+		return 0;
+	unsigned hash = name_hash(name);
+	int nbuckets = dir_buckets(&map);
+	if(nbuckets == 0)
+		return 0;
+	int blocknum = map_get(&map, hash & (nbuckets - 1));
+	union fs_block bucket;
+	disk_read(blocknum, bucket.data);
+	for(int i = 0; i < DIRENTS_PER_BLOCK; i++){
+		struct fs_dirent *entry = &bucket.dirent[i];
+		if(entry->inumber && entry->hash == hash && !strcmp(entry->name, name)){
+			entry->inumber = 0;
+			disk_write(blocknum, bucket.data);
+			dcache_drop(dir, name);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//walk every directory on path except the last component, which is copied
+//into leaf. returns the directory holding leaf, or -1
+static int path_parent(const char *path, char *leaf)
+{
+	int dir = dir_root();
+	if(dir == -1)
+		return -1;
+	leaf[0] = 0;
+	while(1){
+		while(*path == '/')
+			path++;
+		if(!*path)
+			return dir;
+		int len = strcspn(path, "/");
+		if(len > FS_NAME_MAX){
+			printf("name %.*s is too long\n", len, path);
+			return -1;
+		}
+		if(leaf[0]){
+			int next = dir_lookup(dir, leaf);
+			if(next <= 0){
+				if(next == 0)
+					printf("%s doesn't exist\n", leaf);
+				return -1;
+			}
+			dir = next;
+		}
+		memcpy(leaf, path, len);
+		leaf[len] = 0;
+		path += len;
+	}
+}
+
+int fs_lookup( const char *path )
+{
+	char leaf[FS_NAME_MAX + 1];
+	int dir = path_parent(path, leaf);
+	if(dir == -1)
+		return -1;
+	if(!leaf[0])
+		return dir;
+	int inumber = dir_lookup(dir, leaf);
+	return (inumber > 0) ? inumber : -1;
+}
+
+static int path_create(const char *path, int isdir)
+{
+	char leaf[FS_NAME_MAX + 1];
+	int dir = path_parent(path, leaf);
+	if(dir == -1)
+		return -1;
+	if(!leaf[0]){
+		printf("%s already exists\n", path);
+		return -1;
+	}
+	int existing = dir_lookup(dir, leaf);
+	if(existing != 0){
+		if(existing > 0)
+			printf("%s already exists\n", path);
+		return -1;
+	}
+	int inumber = isdir ? dir_new() : inode_alloc(inode_group(dir));
+	if(inumber == -1)
+		return -1;
+	if(!dir_add(dir, leaf, inumber)){
+		if(isdir){
+			struct fs_filemap map;
+			map_open(&map, inumber);
+			map.inode.isvalid &= ~INODE_DIR;
+			map.inode_dirty = 1;
+			map_close(&map);
+		}
+		fs_delete(inumber);
+		return -1;
+	}
+	if(!isdir){
+		struct fs_filemap map;
+		map_open(&map, inumber);
+		map.inode.isvalid |= INODE_NAMED;
+		map.inode_dirty = 1;
+		map_close(&map);
+	}
+	return inumber;
+}
+
+int fs_create_name( const char *path )
+{
+	return path_create(path, 0);
+}
+
+int fs_mkdir( const char *path )
+{
+	return path_create(path, 1);
+}
+
+//remove the name and the inode behind it. directories must be empty
+int fs_unlink( const char *path )
+{
+	char leaf[FS_NAME_MAX + 1];
+	int dir = path_parent(path, leaf);
+	if(dir == -1)
+		return 0;
+	if(!leaf[0]){
+		printf("can't unlink the root directory\n");
+		return 0;
+	}
+	int inumber = dir_lookup(dir, leaf);
+	if(inumber <= 0){
+		printf("%s doesn't exist\n", path);
+		return 0;
+	}
+
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0)
+		return 0;
+	if(map.inode.isvalid & INODE_DIR){
+		int nbuckets = dir_buckets(&map);
+		if(nbuckets == 0)
+			return 0;
+		for(int b = 0; b < nbuckets; b++){
+			union fs_block bucket;
+			disk_read(map_get(&map, b), bucket.data);
+			for(int i = 0; i < DIRENTS_PER_BLOCK; i++){
+				if(bucket.dirent[i].inumber){
+					printf("%s is not empty\n", path);
+					return 0;
+				}
+			}
+		}
+	}
+	if(!dir_remove(dir, leaf))
+		return 0;
+	map.inode.isvalid &= ~(INODE_DIR | INODE_NAMED);
+	map.inode_dirty = 1;
+	map_close(&map);
+	return fs_delete(inumber);
+}
+
+//call emit for every entry of the directory at path. returns the number of
+//entries, or -1
+int fs_readdir( const char *path, void (*emit)( const char *name, int inumber ) )
+{
+	int dir = fs_lookup(path);
+	if(dir == -1)
+		return -1;
+	struct fs_filemap map;
+	if(map_open(&map, dir) <= 0)
+		return -1;
+	if(!(map.inode.isvalid & INODE_DIR)){
+		printf("%s is not a directory\n", path);
+		return -1;
+	}
+	int count = 0;
+	int nbuckets = dir_buckets(&map);
+	if(nbuckets == 0)
+		return -1;
+	for(int b = 0; b < nbuckets; b++){
+		union fs_block bucket;
+		disk_read(map_get(&map, b), bucket.data);
+		for(int i = 0; i < DIRENTS_PER_BLOCK; i++){
+			if(!bucket.dirent[i].inumber)
+				continue;
+			emit(bucket.dirent[i].name, bucket.dirent[i].inumber);
+			count++;
+		}
+	}
+	return count;
+}
+
+//move one file into a single run: indirect block first, then data in
+//logical order. the copies and the new indirect block are written before
+//the inode, so the inode block write is the commit point and a crash at
+//any step leaves either the old layout or the new one. returns the number
+//of blocks moved
+static int defrag_file(int inumber, int budget)
+{
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0)
+		return 0;
+	if(map.inode.isvalid & INODE_SYSTEM)
+		return 0;
+
+	int mapped;
+	if(count_extents(&map.inode, map.indirect.pointers, &mapped) <= 1)
+		return 0;
+	//shared blocks belong to other files too, leave those where they are
+	if(map.inode.indirect && bitmap[map.inode.indirect] > TAKEN)
+		return 0;
+	for(int n = 0; n < MAX_FILE_BLOCKS; n++){
+		int blocknum = map_get(&map, n);
+		if(blocknum && bitmap[blocknum] > TAKEN)
+			return 0;
+	}
+	int need = mapped + (map.inode.indirect ? 1 : 0);
+	if(need > budget)
+		return 0;
+	//gathering the file also pulls it back into its inode's group
+	int start = alloc_run(groups[inode_group(inumber)].first, need);
+	if(start == -1)
+		return 0;
+
+	struct fs_filemap moved = map;
+	int freed[MAX_FILE_BLOCKS + 1];
+	int nfreed = 0;
+	int next = start;
+	if(map.inode.indirect){
+		moved.inode.indirect = next++;
+		release_block(map.inode.indirect, freed, &nfreed);
+	}
+	for(int n = 0; n < MAX_FILE_BLOCKS; n++){
+		int old = map_get(&map, n);
+		if(old == 0)
+			continue;
+		union fs_block datablock;
+		disk_read(old, datablock.data);
+		disk_write(next, datablock.data);
+		if(map.inode.isvalid & INODE_DEDUP)
+			dedup_insert(block_hash(datablock.data), next);
+		if(n < POINTERS_PER_INODE){
+			moved.inode.direct[n] = next;
+		}else{
+			moved.indirect.pointers[n - POINTERS_PER_INODE] = next;
+		}
+		next++;
+		release_block(old, freed, &nfreed);
+	}
+	moved.inode_dirty = 1;
+	moved.indirect_dirty = (moved.inode.indirect != 0);
+	map_close(&moved);
+
+	if(map.inode.isvalid & INODE_DEDUP)
+		dedup_flush();
+	discard_blocks(freed, nfreed);
+	return need;
+}
+
+//one increment of online defragmentation: walk the inode table from where
+//the last call stopped and rewrite fragmented files until maxblocks blocks
+//have been moved. a single file bigger than the budget is still moved when
+//it comes first, so every file makes progress eventually. returns the
+//number of blocks moved
+int fs_defrag( int maxblocks )
+{
+	if(bitmap == NULL){
+		printf("The disk haven't been mounted!\n");
+		return -1;
+	}
+	union fs_block block;
+	disk_read(0, block.data);
+	int ninodes = block.super.ninodes;
+	int loaded = -1;
+	int moved = 0;
+	if(defrag_next < 1 || defrag_next > ninodes)
+		defrag_next = 1;
+
+	for(int scanned = 0; scanned < ninodes && moved < maxblocks; scanned++){
+		int inumber = defrag_next;
+		defrag_next = (defrag_next < ninodes) ? defrag_next + 1 : 1;
+
+		int blocknum = (inumber - 1) / INODES_PER_BLOCK + 1;
+		if(blocknum != loaded){
+			disk_read(blocknum, block.data);
+			loaded = blocknum;
+		}
+		if(!block.inode[(inumber - 1) % INODES_PER_BLOCK].isvalid)
+			continue;
+
+		int n = defrag_file(inumber, moved ? maxblocks - moved : MAX_FILE_BLOCKS + 1);
+		if(n > 0){
+			moved += n;
+			//the inode block on disk just changed under the cached copy
+			loaded = -1;
+		}
+	}
+	return moved;
+}
+
+//a block that can't legitimately have more than one owner: used both as an
+//indirect block and as data, or a directory/index block seen twice
+static int scan_conflict(struct scan_job *scan, int blocknum)
+{
+	char roles = scan->roles[blocknum];
+	if((roles & ROLE_INDIRECT) && (roles & ~ROLE_INDIRECT))
+		return 1;
+	return (roles & ROLE_META) && scan->refs[blocknum] > 1;
+}
+
+//keep a pointer if it is in range and, for a conflicting block, if it uses
+//the block the same way as the first owner the repair pass met. clones
+//legitimately share data and indirect blocks, so only a role mismatch or
+//a second directory/index owner is dropped
+static int repair_pointer(struct scan_job *scan, char *claimed, int blocknum, int role)
+{
+	if(blocknum == 0)
+		return 0;
+	if(blocknum <= scan->super.ninodeblocks || blocknum >= scan->super.nblocks)
+		return 0;
+	if(scan_conflict(scan, blocknum)){
+		if(!claimed[blocknum]){
+			claimed[blocknum] = role;
+		}else if(claimed[blocknum] != role || role == ROLE_META){
+			return 0;
+		}
+	}
+	return blocknum;
+}
+
+//drop a pointer to a block the same non-dedup inode already points at
+static int repair_once(int *owner, int inumber, int blocknum)
+{
+	if(blocknum == 0)
+		return 0;
+	if(owner[blocknum] == inumber)
+		return 0;
+	owner[blocknum] = inumber;
+	return blocknum;
+}
+
+//serial pass over the inode table that drops every pointer the scan found
+//bad. shared indirect blocks are only fixed the first time they are seen
+static void repair_inodes(struct scan_job *scan)
+{
+	char *claimed = calloc(scan->super.nblocks, 1);
+	char *visited = calloc(scan->super.nblocks, 1);
+	int *owner = calloc(scan->super.nblocks, sizeof(int));
+	union fs_block block, indirect;
+	int k;
+
+	for(int i = 1; i <= scan->super.ninodeblocks; i++){
+		int changed = 0;
+		disk_read(i, block.data);
+		for(int j = 0; j < INODES_PER_BLOCK; j++){
+			struct fs_inode *inode = &block.inode[j];
+			if(!inode->isvalid)
+				continue;
+			int role = (inode->isvalid & (INODE_DIR | INODE_SYSTEM)) ? ROLE_META : ROLE_DATA;
+			int inumber = (i - 1) * INODES_PER_BLOCK + j + 1;
+			int once = !(inode->isvalid & INODE_DEDUP);
+			if(inode->size < 0 || inode->size > MAX_FILE_BLOCKS * BLOCK_SIZE){
+				inode->size = (inode->size < 0) ? 0 : MAX_FILE_BLOCKS * BLOCK_SIZE;
+				changed = 1;
+			}
+			for(k = 0; k < POINTERS_PER_INODE; k++){
+				int fixed = repair_pointer(scan, claimed, inode->direct[k], role);
+				if(once)
+					fixed = repair_once(owner, inumber, fixed);
+				if(fixed != inode->direct[k]){
+					inode->direct[k] = fixed;
+					changed = 1;
+				}
+			}
+			int fixed = repair_pointer(scan, claimed, inode->indirect, ROLE_INDIRECT);
+			if(once)
+				fixed = repair_once(owner, inumber, fixed);
+			if(fixed != inode->indirect){
+				inode->indirect = fixed;
+				changed = 1;
+			}
+			if(!inode->indirect || visited[inode->indirect])
+				continue;
+			visited[inode->indirect] = 1;
+			int dirty = 0;
+			disk_read(inode->indirect, indirect.data);
+			for(k = 0; k < POINTERS_PER_BLOCK; k++){
+				fixed = repair_pointer(scan, claimed, indirect.pointers[k], role);
+				if(once)
+					fixed = repair_once(owner, inumber, fixed);
+				if(fixed != indirect.pointers[k]){
+					indirect.pointers[k] = fixed;
+					dirty = 1;
+				}
+			}
+			if(dirty)
+				disk_write(inode->indirect, indirect.data);
+		}
+		if(changed)
+			disk_write(i, block.data);
+	}
+	free(claimed);
+	free(visited);
+	free(owner);
+}
+
+static double elapsed_since(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//check every inode for out of range pointers, impossible sizes, broken
+//directories and blocks with conflicting owners, and compare the block
+//reference counts with the mounted bitmap. with repair set, bad pointers
+//are dropped and the bitmap is rebuilt. returns the number of problems
+//found, or -1 if there is no filesystem to check
+int fs_check( int nthreads, int repair )
+{
+	union fs_block block;
+	struct scan_job scan;
+	struct timespec start;
+	int problems, b;
+
+	disk_read(0, block.data);
+	if(block.super.magic != FS_MAGIC || block.super.nblocks != disk_size()
+	   || block.super.ninodeblocks <= 0 || block.super.ninodeblocks >= block.super.nblocks){
+		printf("superblock is not valid\n");
+		return -1;
+	}
+	if(nthreads <= 0)
+		nthreads = scan_threads();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	scan_inodes(&block.super, nthreads, 1, &scan);
+	double seconds = elapsed_since(&start);
+	int nscanned = block.super.ninodeblocks + scan.nindirect;
+	printf("scanned %d inode blocks and %d indirect blocks with %d threads in %.3f s (%.1f MB/s)\n",
+	       block.super.ninodeblocks, scan.nindirect, nthreads, seconds,
+	       seconds > 0 ? nscanned * (double)BLOCK_SIZE / (1 << 20) / seconds : 0.0);
+
+	problems = scan.nerrors;
+	int nconflicts = 0;
+	for(b = 0; b < block.super.nblocks; b++){
+		if(scan_conflict(&scan, b)){
+			printf("block %d has more than one owner\n", b);
+			nconflicts++;
+		}
+	}
+	problems += nconflicts;
+
+	if(repair && problems){
+		repair_inodes(&scan);
+		free(scan.refs);
+		free(scan.roles);
+		scan_inodes(&block.super, nthreads, 0, &scan);
+	}
+
+	if(bitmap != NULL){
+		int wrong = 0;
+		for(b = block.super.ninodeblocks + 1; b < block.super.nblocks; b++){
+			if(bitmap[b] != scan.refs[b])
+				wrong++;
+		}
+		if(wrong){
+			printf("%d bitmap entries are wrong\n", wrong);
+			problems++;
+		}
+		for(int g = 0; g < ngroups; g++){
+			int nfree = 0;
+			for(b = groups[g].first; b < groups[g].last; b++){
+				if(bitmap[b] == FREE)
+					nfree++;
+			}
+			if(nfree != groups[g].nfree){
+				printf("group %d counts %d free blocks but has %d\n", g, groups[g].nfree, nfree);
+				problems++;
+				wrong++;
+			}
+		}
+		if(repair && wrong){
+			//blocks nothing references any more go back to the host
+			int *freed = malloc(block.super.nblocks * sizeof(int));
+			int nfreed = 0;
+			for(b = block.super.ninodeblocks + 1; b < block.super.nblocks; b++){
+				if(bitmap[b] != FREE && scan.refs[b] == FREE)
+					freed[nfreed++] = b;
+				bitmap[b] = scan.refs[b];
+			}
+			group_count();
+			if(dedup_slot){
+				dedup_prune(block.super.nblocks);
+				dedup_flush();
+			}
+			discard_blocks(freed, nfreed);
+			free(freed);
+		}
+	}
+
+	free(scan.refs);
+	free(scan.roles);
+	if(repair && problems - scan.nbrokendirs > 0)
+		printf("repaired %d problems\n", problems - scan.nbrokendirs);
+	if(repair && scan.nbrokendirs)
+		printf("%d directories with a broken bucket table were left as they are\n", scan.nbrokendirs);
+	return problems;
+}
+
+//host transfers for files whose blocks don't hold the bytes verbatim
+static int import_buffered(int inumber, int fd, int length)
+{
+	char *buffer;
+	int done = 0;
+	if(posix_memalign((void **)&buffer, BLOCK_SIZE, COPY_BUFFER_SIZE))
+		return -1;
+	while(done < length){
+		int chunk = (length - done < COPY_BUFFER_SIZE) ? length - done : COPY_BUFFER_SIZE;
+		int result = read(fd, buffer, chunk);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			break;
+		int actual = fs_write(inumber, buffer, result, done);
+		if(actual > 0)
+			done += actual;
+		if(actual != result)
+			break;
+	}
+	free(buffer);
+	return done;
+}
+
+static int write_all(int fd, const char *data, int length)
+{
+	int done = 0;
+	while(done < length){
+		int result = write(fd, data + done, length - done);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			break;
+		done += result;
+	}
+	return done;
+}
+
+static int export_buffered(int inumber, int fd)
+{
+	char *buffer;
+	int done = 0;
+	if(posix_memalign((void **)&buffer, BLOCK_SIZE, COPY_BUFFER_SIZE))
+		return -1;
+	while(1){
+		int result = fs_read(inumber, buffer, COPY_BUFFER_SIZE, done);
+		if(result <= 0)
+			break;
+		int written = write_all(fd, buffer, result);
+		done += written;
+		if(written != result)
+			break;
+	}
+	free(buffer);
+	return done;
+}
+
+//number of logical blocks from n on that sit in consecutive disk blocks
+static int map_run(struct fs_filemap *map, int n, int limit)
+{
+	int first = map_get(map, n);
+	int count = 1;
+	while(n + count < limit && first && map_get(map, n + count) == first + count)
+		count++;
+	return count;
+}
+
+//fill an empty inode with length bytes read from the host descriptor fd.
+//a plain file gets all of its blocks laid out first, in one free run when
+//there is one, and each physical run is then filled straight from fd by
+//the disk layer with no copy through fs_write. returns the bytes imported
+int fs_import( int inumber, int fd, int length )
+{
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0 || length < 0)
+		return -1;
+	if(map.inode.isvalid & (INODE_SYSTEM | INODE_DIR)){
+		printf("inode %d is reserved!\n", inumber);
+		return -1;
+	}
+	if(map.inode.size != 0 || (map.inode.isvalid & (INODE_COMPRESSED | INODE_DEDUP)))
+		return import_buffered(inumber, fd, length);
+
+	int nblocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(nblocks > MAX_FILE_BLOCKS)
+		nblocks = MAX_FILE_BLOCKS;
+	if(nblocks > POINTERS_PER_INODE && !map_reserve(&map, nblocks - 1))
+		nblocks = POINTERS_PER_INODE;
+
+	int start = alloc_run(map_goal(&map, 0), nblocks);
+	int n;
+	for(n = 0; n < nblocks; n++){
+		int blocknum = (start != -1) ? start + n : alloc_block(map_goal(&map, n));
+		if(blocknum == -1)
+			break;
+		map_set(&map, n, blocknum);
+	}
+	nblocks = n;
+	if(length > nblocks * BLOCK_SIZE)
+		length = nblocks * BLOCK_SIZE;
+
+	//the inode is written only after its data, so it never points at garbage
+	int done = 0;
+	for(n = 0; n < nblocks; ){
+		int count = map_run(&map, n, nblocks);
+		int bytes = (length - done < count * BLOCK_SIZE) ? length - done : count * BLOCK_SIZE;
+		int result = disk_import(map_get(&map, n), count, fd, bytes);
+		done += result;
+		if(result < bytes)
+			break;
+		n += count;
+	}
+
+	//a host file shorter than length leaves blocks past its data, and
+	//maybe an indirect block nothing needs any more
+	int freed[MAX_FILE_BLOCKS + 1];
+	int nfreed = 0;
+	int used = (done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for(n = used; n < nblocks; n++){
+		release_block(map_get(&map, n), freed, &nfreed);
+		map_set(&map, n, 0);
+	}
+	if(used <= POINTERS_PER_INODE && map.inode.indirect){
+		release_block(map.inode.indirect, freed, &nfreed);
+		map.inode.indirect = 0;
+		map.indirect_dirty = 0;
+	}
+	map.inode.size = done;
+	map.inode_dirty = 1;
+	map_close(&map);
+	discard_blocks(freed, nfreed);
+	return done;
+}
+
+//write the whole file to the host descriptor fd at its current position,
+//handing each physically contiguous run to the disk layer in one call.
+//returns the bytes exported
+int fs_export( int inumber, int fd )
+{
+	static const char zero[BLOCK_SIZE];
+	struct fs_filemap map;
+	if(map_open(&map, inumber) <= 0)
+		return -1;
+	if(map.inode.isvalid & INODE_COMPRESSED)
+		return export_buffered(inumber, fd);
+
+	int size = map.inode.size;
+	int done = 0;
+	int n = 0;
+	while(done < size){
+		int count = map_run(&map, n, MAX_FILE_BLOCKS);
+		int bytes = (size - done < count * BLOCK_SIZE) ? size - done : count * BLOCK_SIZE;
+		int result;
+		if(map_get(&map, n) == 0){
+			result = write_all(fd, zero, bytes);
+		}else{
+			result = disk_export(map_get(&map, n), fd, bytes);
+		}
+		done += result;
+		if(result < bytes)
+			break;
+		n += count;
+	}
+	return done;
+}
+
+//one host file in a bulk ingest. blocks holds the planned layout in
+//logical order, indirect is 0 for files that fit in the direct pointers
+struct ingest_file {
+	int fd;
+	int length;
+	int inumber;
+	int nblocks;
+	int indirect;
+	int *planned;  //indirect block, if any, then the data blocks
+	int *blocks;
+	int copied;
+};
+
+struct ingest_job {
+	struct ingest_file *files;
+	int nfiles;
+	int next;   //next file to hand out, taken atomically
+	int full;   //set when some file couldn't get all its blocks
+};
+
+//lay a file out as its indirect block followed by its data, as one run in
+//its inode's group when there is room. a file the disk can't hold in full
+//is truncated
+static void ingest_plan(struct ingest_job *job, struct ingest_file *file)
+{
+	int want = (file->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int need = want + (want > POINTERS_PER_INODE);
+	int goal = groups[inode_group(file->inumber)].first;
+	file->planned = malloc((need + 1) * sizeof(int));
+	int start = alloc_run(goal, need);
+	int got;
+	for(got = 0; got < need; got++){
+		int blocknum = (start != -1) ? start + got : alloc_block(got ? file->planned[got - 1] + 1 : goal);
+		if(blocknum == -1)
+			break;
+		file->planned[got] = blocknum;
+	}
+	if(want > POINTERS_PER_INODE && got > POINTERS_PER_INODE){
+		file->indirect = file->planned[0];
+		file->blocks = file->planned + 1;
+		file->nblocks = got - 1;
+	}else{
+		file->blocks = file->planned;
+		file->nblocks = got;
+	}
+	if(got < need)
+		job->full = 1;
+	if(file->length > file->nblocks * BLOCK_SIZE)
+		file->length = file->nblocks * BLOCK_SIZE;
+}
+
+//workers pull whole files off the shared list, plan them and copy them.
+//files in different groups allocate under different locks, and each file
+//owns its blocks and its host descriptor, so the copies need no locking
+static void *ingest_worker(void *arg)
+{
+	struct ingest_job *job = arg;
+	int i;
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nfiles){
+		struct ingest_file *file = &job->files[i];
+		if(file->fd < 0 || file->inumber == 0)
+			continue;
+		ingest_plan(job, file);
+		int n = 0;
+		while(n < file->nblocks){
+			int count = 1;
+			while(n + count < file->nblocks && file->blocks[n + count] == file->blocks[n] + count)
+				count++;
+			int bytes = (file->length - file->copied < count * BLOCK_SIZE) ? file->length - file->copied : count * BLOCK_SIZE;
+			int result = disk_import(file->blocks[n], count, file->fd, bytes);
+			file->copied += result;
+			if(result < bytes)
+				break;
+			n += count;
+		}
+	}
+	return NULL;
+}
+
+static int compare_inumber(const void *a, const void *b)
+{
+	return (*(struct ingest_file * const *)a)->inumber - (*(struct ingest_file * const *)b)->inumber;
+}
+
+//copy many host files in at once. inodes are claimed in one pass over the
+//inode table, spread evenly over the allocation groups, then nthreads
+//workers each plan a file's whole extent in its group and copy the data in
+//parallel. the indirect blocks and finally each touched inode block are
+//written once at the end, so a crash mid-ingest leaves none of the new
+//files visible. inumbers[i] gets the inode for paths[i], or -1 if it
+//couldn't be ingested. returns the number of files ingested
+int fs_ingest( const char **paths, int npaths, int *inumbers, int nthreads )
+{
+	if(bitmap == NULL){
+		printf("The disk haven't been mounted!\n");
+		return -1;
+	}
+	if(nthreads < 1)
+		nthreads = scan_threads();
+	if(nthreads > SCAN_MAX_THREADS)
+		nthreads = SCAN_MAX_THREADS;
+
+	union fs_block block;
+	struct ingest_file *files = calloc(npaths, sizeof(struct ingest_file));
+	struct ingest_file **order = malloc(npaths * sizeof(struct ingest_file *));
+	int i, n, nvalid = 0;
+
+	//open everything first, so a missing file doesn't cost an inode
+	for(i = 0; i < npaths; i++){
+		struct stat info;
+		inumbers[i] = -1;
+		files[i].fd = open(paths[i], O_RDONLY);
+		if(files[i].fd < 0){
+			printf("couldn't open %s: %s\n", paths[i], strerror(errno));
+			continue;
+		}
+		if(fstat(files[i].fd, &info) < 0 || !S_ISREG(info.st_mode)){
+			printf("%s is not a regular file\n", paths[i]);
+			close(files[i].fd);
+			files[i].fd = -1;
+			continue;
+		}
+		long long length = info.st_size;
+		if(length > (long long)MAX_FILE_BLOCKS * BLOCK_SIZE)
+			length = (long long)MAX_FILE_BLOCKS * BLOCK_SIZE;
+		files[i].length = length;
+		order[nvalid++] = &files[i];
+	}
+
+	//claim free inode slots, giving each group an even share of the files
+	//so the workers spread out over the groups. a group that runs short
+	//passes the rest on, and a second pass picks up whatever the first
+	//left free. nothing is written yet: the slots stay free on disk until
+	//the commit below
+	int *resume = calloc(ngroups, sizeof(int));
+	int claimed = 0;
+	for(int pass = 0; pass < 2 && claimed < nvalid; pass++){
+		for(int g = 0; g < ngroups && claimed < nvalid; g++){
+			struct fs_group *group = &groups[g];
+			int quota = pass ? nvalid : (nvalid - claimed + ngroups - g - 1) / (ngroups - g);
+			int slots = (group->lastinode - group->firstinode) * INODES_PER_BLOCK;
+			int loaded = -1;
+			for(int taken = 0; taken < quota && resume[g] < slots && claimed < nvalid; resume[g]++){
+				int b = group->firstinode + resume[g] / INODES_PER_BLOCK;
+				int j = resume[g] % INODES_PER_BLOCK;
+				if(b != loaded){
+					disk_read(b, block.data);
+					loaded = b;
+				}
+				if(block.inode[j].isvalid != 0)
+					continue;
+				order[claimed++]->inumber = (b - 1) * INODES_PER_BLOCK + j + 1;
+				taken++;
+			}
+		}
+	}
+	free(resume);
+
+	struct ingest_job job = { files, npaths, 0, 0 };
+	pthread_t threads[SCAN_MAX_THREADS];
+	int started = 0;
+	for(n = 0; n < nthreads; n++){
+		if(pthread_create(&threads[n], NULL, ingest_worker, &job) != 0)
+			break;
+		started++;
+	}
+	if(started == 0)
+		ingest_worker(&job);
+	for(n = 0; n < started; n++)
+		pthread_join(threads[n], NULL);
+	if(job.full)
+		printf("disk full, some files were truncated\n");
+
+	//give back and punch whatever a short read left unused, then write the
+	//indirect blocks, and only then the inodes that point at them
+	for(i = 0; i < claimed; i++){
+		struct ingest_file *file = order[i];
+		int freed[MAX_FILE_BLOCKS + 1];
+		int nfreed = 0;
+		int used = (file->copied + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for(n = used; n < file->nblocks; n++)
+			release_block(file->blocks[n], freed, &nfreed);
+		file->nblocks = used;
+		if(file->indirect && used <= POINTERS_PER_INODE){
+			release_block(file->indirect, freed, &nfreed);
+			file->indirect = 0;
+		}
+		discard_blocks(freed, nfreed);
+		if(file->indirect){
+			memset(block.data, 0, BLOCK_SIZE);
+			for(n = POINTERS_PER_INODE; n < used; n++)
+				block.pointers[n - POINTERS_PER_INODE] = file->blocks[n];
+			disk_write(file->indirect, block.data);
+		}
+	}
+
+	//in inumber order, files sharing an inode block are adjacent and each
+	//block is read and written once
+	qsort(order, claimed, sizeof(struct ingest_file *), compare_inumber);
+	for(i = 0; i < claimed; ){
+		int b = (order[i]->inumber - 1) / INODES_PER_BLOCK + 1;
+		disk_read(b, block.data);
+		for(; i < claimed && (order[i]->inumber - 1) / INODES_PER_BLOCK + 1 == b; i++){
+			struct ingest_file *file = order[i];
+			struct fs_inode *inode = &block.inode[(file->inumber - 1) % INODES_PER_BLOCK];
+			memset(inode, 0, sizeof(struct fs_inode));
+			inode->isvalid = INODE_VALID;
+			inode->size = file->copied;
+			for(n = 0; n < file->nblocks && n < POINTERS_PER_INODE; n++)
+				inode->direct[n] = file->blocks[n];
+			inode->indirect = file->indirect;
+			inumbers[file - files] = file->inumber;
+		}
+		disk_write(b, block.data);
+	}
+
+	for(i = 0; i < npaths; i++){
+		if(files[i].fd >= 0){
+			if(files[i].inumber == 0)
+				printf("out of inodes for %s\n", paths[i]);
+			close(files[i].fd);
+		}
+		free(files[i].planned);
+	}
+	free(files);
+	free(order);
+	return claimed;
 }
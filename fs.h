@@ -4,12 +4,26 @@
 void fs_debug();
 int  fs_format();
 int  fs_mount();
+int  fs_check( int nthreads, int repair );
 
 int  fs_create();
 int  fs_delete( int inumber );
+int  fs_clone( int inumber );
 int  fs_getsize();
+int  fs_compress( int inumber );
+int  fs_dedup( int inumber );
+int  fs_defrag( int maxblocks );
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_import( int inumber, int fd, int length );
+int  fs_export( int inumber, int fd );
+int  fs_ingest( const char **paths, int npaths, int *inumbers, int nthreads );
+
+int  fs_lookup( const char *path );
+int  fs_create_name( const char *path );
+int  fs_mkdir( const char *path );
+int  fs_unlink( const char *path );
+int  fs_readdir( const char *path, void (*emit)( const char *name, int inumber ) );
 
 #endif
\ No newline at end of file
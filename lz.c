@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "lz.h"
+
+/*
+A small LZ77 codec in the style of LZ4. The stream is a list of sequences:
+a token byte (high nibble literal count, low nibble match length minus
+LZ_MIN_MATCH, 15 meaning more length bytes follow), the literals, then a
+two byte little-endian match offset. The final sequence carries literals only.
+*/
+
+#define LZ_HASH_BITS  12
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+
+static unsigned lz_read32( const unsigned char *p )
+{
+	unsigned v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static unsigned lz_hash( unsigned v )
+{
+	return (v*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+static int lz_putlen( unsigned char *out, int op, int dstmax, int len )
+{
+	while(len>=255) {
+		if(op>=dstmax) return -1;
+		out[op++] = 255;
+		len -= 255;
+	}
+	if(op>=dstmax) return -1;
+	out[op++] = len;
+	return op;
+}
+
+static int lz_sequence( unsigned char *out, int op, int dstmax, const unsigned char *lit, int litlen, int offset, int matchlen )
+{
+	int mcode = matchlen ? matchlen-LZ_MIN_MATCH : 0;
+
+	if(op>=dstmax) return -1;
+	out[op++] = ((litlen<15 ? litlen : 15)<<4) | (mcode<15 ? mcode : 15);
+	if(litlen>=15 && (op=lz_putlen(out,op,dstmax,litlen-15))<0) return -1;
+
+	if(op+litlen>dstmax) return -1;
+	memcpy(out+op,lit,litlen);
+	op += litlen;
+
+	if(!matchlen) return op;
+
+	if(op+2>dstmax) return -1;
+	out[op++] = offset & 0xff;
+	out[op++] = offset >> 8;
+	if(mcode>=15 && (op=lz_putlen(out,op,dstmax,mcode-15))<0) return -1;
+	return op;
+}
+
+// returns the compressed length, or 0 if it would not fit in dstmax bytes
+int lz_compress( const char *src, int srclen, char *dst, int dstmax )
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	int table[1<<LZ_HASH_BITS];
+	int ip=0, anchor=0, op=0;
+
+	memset(table,0xff,sizeof(table));
+
+	while(ip+LZ_MIN_MATCH<=srclen) {
+		unsigned v = lz_read32(in+ip);
+		unsigned h = lz_hash(v);
+		int ref = table[h];
+		table[h] = ip;
+
+		if(ref<0 || ip-ref>LZ_MAX_OFFSET || lz_read32(in+ref)!=v) {
+			ip++;
+			continue;
+		}
+
+		int len = LZ_MIN_MATCH;
+		while(ip+len<srclen && in[ref+len]==in[ip+len]) len++;
+
+		op = lz_sequence(out,op,dstmax,in+anchor,ip-anchor,ip-ref,len);
+		if(op<0) return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_sequence(out,op,dstmax,in+anchor,srclen-anchor,0,0);
+	if(op<0) return 0;
+	return op;
+}
+
+// returns the decompressed length, or -1 if the stream is corrupt
+int lz_decompress( const char *src, int srclen, char *dst, int dstmax )
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	int ip=0, op=0;
+
+	while(ip<srclen) {
+		int token = in[ip++];
+		int litlen = token>>4;
+		int matchlen = token&15;
+
+		if(litlen==15) {
+			int b;
+			do {
+				if(ip>=srclen) return -1;
+				b = in[ip++];
+				litlen += b;
+			} while(b==255);
+		}
+
+		if(ip+litlen>srclen || op+litlen>dstmax) return -1;
+		memcpy(out+op,in+ip,litlen);
+		ip += litlen;
+		op += litlen;
+
+		if(ip==srclen) break;
+
+		if(ip+2>srclen) return -1;
+		int offset = in[ip] | (in[ip+1]<<8);
+		ip += 2;
+
+		if(matchlen==15) {
+			int b;
+			do {
+				if(ip>=srclen) return -1;
+				b = in[ip++];
+				matchlen += b;
+			} while(b==255);
+		}
+		matchlen += LZ_MIN_MATCH;
+
+		if(offset==0 || offset>op || op+matchlen>dstmax) return -1;
+
+		// byte at a time, since the match may overlap what it is copying
+		for(int i=0;i<matchlen;i++) {
+			out[op+i] = out[op-offset+i];
+		}
+		op += matchlen;
+	}
+
+	return op;
+}
@@ -5,9 +5,13 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static void print_dirent( const char *name, int inumber );
+static int do_ingest( const char *source );
 
 int main( int argc, char *argv[] )
 {
@@ -61,12 +65,36 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"fsck")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"repair"))) {
+				result = fs_check(0,args==2);
+				if(result==0) {
+					printf("filesystem is clean.\n");
+				} else if(result>0) {
+					printf("%d problems found.\n",result);
+				} else {
+					printf("fsck failed!\n");
+				}
+			} else {
+				printf("use: fsck [repair]\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==1 || args==2) {
+				result = fs_defrag((args==2) ? atoi(arg1) : 256);
+				if(result>=0) {
+					printf("defrag moved %d blocks\n",result);
+				} else {
+					printf("defrag failed!\n");
+				}
+			} else {
+				printf("use: defrag [maxblocks]\n");
+			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
@@ -81,8 +109,8 @@ int main( int argc, char *argv[] )
 			}
 			
 		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
+			if(args==1 || args==2) {
+				inumber = (args==2) ? fs_create_name(arg1) : fs_create();
 				/* Bug fixed on April 30th: check for inumber>=0 */
 				if(inumber>=0) {
 					printf("created inode %d\n",inumber);
@@ -90,7 +118,62 @@ int main( int argc, char *argv[] )
 					printf("create failed!\n");
 				}
 			} else {
-				printf("use: create\n");
+				printf("use: create [path]\n");
+			}
+		} else if(!strcmp(cmd,"mkdir")) {
+			if(args==2) {
+				inumber = fs_mkdir(arg1);
+				if(inumber>=0) {
+					printf("created directory %s as inode %d\n",arg1,inumber);
+				} else {
+					printf("mkdir failed!\n");
+				}
+			} else {
+				printf("use: mkdir <path>\n");
+			}
+		} else if(!strcmp(cmd,"lookup")) {
+			if(args==2) {
+				inumber = fs_lookup(arg1);
+				if(inumber>=0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("lookup failed!\n");
+				}
+			} else {
+				printf("use: lookup <path>\n");
+			}
+		} else if(!strcmp(cmd,"ls")) {
+			if(args==1 || args==2) {
+				result = fs_readdir((args==2) ? arg1 : "/",print_dirent);
+				if(result>=0) {
+					printf("%d entries\n",result);
+				} else {
+					printf("ls failed!\n");
+				}
+			} else {
+				printf("use: ls [path]\n");
+			}
+		} else if(!strcmp(cmd,"unlink")) {
+			if(args==2) {
+				if(fs_unlink(arg1)) {
+					printf("%s removed.\n",arg1);
+				} else {
+					printf("unlink failed!\n");
+				}
+			} else {
+				printf("use: unlink <path>\n");
+			}
+		} else if(!strcmp(cmd,"clone")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				result = fs_clone(inumber);
+				if(result>=0) {
+					printf("cloned inode %d to inode %d\n",inumber,result);
+				} else {
+					printf("clone failed!\n");
+				}
+			} else {
+				printf("use: clone <inumber>\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
@@ -103,6 +186,28 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: delete <inumber>\n");
 			}
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				if(fs_compress(inumber)) {
+					printf("inode %d will be stored compressed.\n",inumber);
+				} else {
+					printf("compress failed!\n");
+				}
+			} else {
+				printf("use: compress <inumber>\n");
+			}
+		} else if(!strcmp(cmd,"dedup")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				if(fs_dedup(inumber)) {
+					printf("inode %d will be stored deduplicated.\n",inumber);
+				} else {
+					printf("dedup failed!\n");
+				}
+			} else {
+				printf("use: dedup <inumber>\n");
+			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
@@ -137,17 +242,36 @@ int main( int argc, char *argv[] )
 				printf("use: copyout <inumber> <filename>\n");
 			}
 
+		} else if(!strcmp(cmd,"ingest")) {
+			if(args==2) {
+				if(!do_ingest(arg1)) {
+					printf("ingest failed!\n");
+				}
+			} else {
+				printf("use: ingest <directory|manifest>\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
 			printf("    format\n");
 			printf("    mount\n");
 			printf("    debug\n");
-			printf("    create\n");
+			printf("    fsck    [repair]\n");
+			printf("    defrag  [maxblocks]\n");
+			printf("    create  [path]\n");
+			printf("    mkdir   <path>\n");
+			printf("    lookup  <path>\n");
+			printf("    ls      [path]\n");
+			printf("    unlink  <path>\n");
 			printf("    delete  <inode>\n");
+			printf("    clone   <inode>\n");
+			printf("    compress <inode>\n");
+			printf("    dedup   <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    getsize <inode> \n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    ingest  <directory|manifest>\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -181,6 +305,21 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	/* regular files have a known size, so the data can go
+	   straight from the file into the image */
+	struct stat info;
+	if(fstat(fileno(file),&info)==0 && S_ISREG(info.st_mode)) {
+		int length = (info.st_size>0x7fffffff) ? 0x7fffffff : info.st_size;
+		offset = fs_import(inumber,fileno(file),length);
+		fclose(file);
+		if(offset<0) return 0;
+		if(offset!=length) {
+			printf("WARNING: fs_import only copied %d bytes, not %d bytes\n",offset,length);
+		}
+		printf("%d bytes copied\n",offset);
+		return 1;
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
@@ -207,8 +346,7 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int offset=0;
 
 	file = fopen(filename,"w");
 	if(!file) {
@@ -216,11 +354,13 @@ static int do_copyout( int inumber, const char *filename )
 		return 0;
 	}
 
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+	/* fs_export writes to the descriptor directly, so nothing
+	   may sit in stdio buffers ahead of it */
+	fflush(stdout);
+	offset = fs_export(inumber,fileno(file));
+	if(offset<0) {
+		fclose(file);
+		return 0;
 	}
 
 	printf("%d bytes copied\n",offset);
@@ -228,3 +368,73 @@ static int do_copyout( int inumber, const char *filename )
 	fclose(file);
 	return 1;
 }
+
+static void print_dirent( const char *name, int inumber )
+{
+	printf("%8d %s\n",inumber,name);
+}
+/* collect the regular files in a host directory, or the paths
+   listed one per line in a manifest, and copy them all in with
+   one fs_ingest */
+static int do_ingest( const char *source )
+{
+	char **paths = 0;
+	int npaths=0, maxpaths=0, i, result;
+	char path[4096];
+	struct stat info;
+
+	if(stat(source,&info)<0) {
+		printf("couldn't open %s: %s\n",source,strerror(errno));
+		return 0;
+	}
+
+	if(S_ISDIR(info.st_mode)) {
+		DIR *dir = opendir(source);
+		struct dirent *entry;
+		if(!dir) {
+			printf("couldn't open %s: %s\n",source,strerror(errno));
+			return 0;
+		}
+		while((entry=readdir(dir))) {
+			snprintf(path,sizeof(path),"%s/%s",source,entry->d_name);
+			if(stat(path,&info)<0 || !S_ISREG(info.st_mode)) continue;
+			if(npaths==maxpaths) {
+				maxpaths = maxpaths ? maxpaths*2 : 64;
+				paths = realloc(paths,maxpaths*sizeof(char*));
+			}
+			paths[npaths++] = strdup(path);
+		}
+		closedir(dir);
+	} else {
+		FILE *file = fopen(source,"r");
+		if(!file) {
+			printf("couldn't open %s: %s\n",source,strerror(errno));
+			return 0;
+		}
+		while(fgets(path,sizeof(path),file)) {
+			path[strcspn(path,"\r\n")] = 0;
+			if(!path[0]) continue;
+			if(npaths==maxpaths) {
+				maxpaths = maxpaths ? maxpaths*2 : 64;
+				paths = realloc(paths,maxpaths*sizeof(char*));
+			}
+			paths[npaths++] = strdup(path);
+		}
+		fclose(file);
+	}
+
+	int *inumbers = malloc((npaths ? npaths : 1)*sizeof(int));
+	result = fs_ingest((const char **)paths,npaths,inumbers,0);
+	for(i=0;i<npaths;i++) {
+		if(result>=0 && inumbers[i]>0) {
+			printf("%s -> inode %d\n",paths[i],inumbers[i]);
+		}
+		free(paths[i]);
+	}
+	free(paths);
+	free(inumbers);
+
+	if(result<0) return 0;
+	printf("ingested %d of %d files\n",result,npaths);
+	return 1;
+}